@@ -0,0 +1,115 @@
+#ifndef __BUILDARENA_H__
+#define __BUILDARENA_H__
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <span>
+#include <type_traits>
+#include <vector>
+
+// ------------------ Build arena ------------------
+// Monotonic allocator for the scratch data of a spatial build: per-triangle
+// bounds, reference lists, pending nodes. Nothing is freed one by one, Reset()
+// makes everything reusable at once and keeps the memory, so rebuilding the same
+// mesh (SetTransform on a moved object) does not go back to the heap. Blocks
+// added while building are merged into one on Reset, the next build of the same
+// size fits it. Not thread-safe: parallel tasks each take their own arena.
+class BuildArena : public std::pmr::memory_resource
+{
+public:
+    // a position in the arena, Rewind(mark) drops everything allocated after it
+    struct Mark
+    {
+        size_t block;
+        size_t used;
+    };
+
+    BuildArena() = default;
+    // containers built on it point at it
+    BuildArena(const BuildArena &) = delete;
+    BuildArena &operator=(const BuildArena &) = delete;
+
+    // count uninitialized elements, only for plain data
+    template <class T>
+    std::span<T> Alloc(size_t count)
+    {
+        static_assert(std::is_trivially_copyable_v<T> && std::is_trivially_destructible_v<T>, "the arena never runs destructors");
+        return {(T *)allocate(count * sizeof(T), alignof(T)), count};
+    }
+
+    Mark GetMark() const { return {cur, used}; }
+
+    // everything allocated after mark must be unused by now
+    void Rewind(const Mark &mark)
+    {
+        cur = mark.block;
+        used = mark.used;
+    }
+
+    void Reset()
+    {
+        if (blocks.size() > 1)
+        {
+            size_t total = Capacity();
+            blocks.clear();
+            blocks.push_back({std::make_unique<std::byte[]>(total), total});
+        }
+        cur = 0;
+        used = 0;
+    }
+
+    // bytes held, used or not
+    size_t Capacity() const
+    {
+        size_t total = 0;
+        for (const Block &b : blocks)
+            total += b.size;
+        return total;
+    }
+
+private:
+    struct Block
+    {
+        std::unique_ptr<std::byte[]> data;
+        size_t size;
+    };
+
+    static const size_t minBlockSize = 64 * 1024;
+
+    std::vector<Block> blocks;
+    size_t cur = 0;     // block allocated from
+    size_t used = 0;    // bytes used in it
+
+    void *do_allocate(size_t bytes, size_t alignment) override
+    {
+        // later blocks are kept by Rewind, the first one large enough is reused
+        for (; cur < blocks.size(); cur++, used = 0)
+        {
+            size_t offset = (used + alignment - 1) & ~(alignment - 1);
+            if (offset + bytes <= blocks[cur].size)
+            {
+                used = offset + bytes;
+                return blocks[cur].data.get() + offset;
+            }
+        }
+
+        // at least doubles what is held, new[] aligns for any type a build uses
+        size_t size = std::max(bytes, std::max(minBlockSize, Capacity()));
+        blocks.push_back({std::make_unique<std::byte[]>(size), size});
+        cur = blocks.size() - 1;
+        used = bytes;
+        return blocks[cur].data.get();
+    }
+
+    // monotonic: memory comes back on Reset or Rewind only
+    void do_deallocate(void *, size_t, size_t) override {}
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        return this == &other;
+    }
+};
+
+#endif
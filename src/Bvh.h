@@ -0,0 +1,799 @@
+#ifndef __BVH_H__
+#define __BVH_H__
+
+#include "Spatial.h"
+#include "RayPacket.h"
+#include "ThreadPool.h"
+#include "WideBvh.h"
+#include "SpatialCache.h"
+
+#include <bit>
+
+// ------------------ BVH (binned SAH or LBVH) ------------------
+class Bvh : public Spatial
+{
+public:
+    struct Node
+    {
+        AABB box;
+        int leftFirst;  // left child for inner nodes (right is leftFirst + 1), first triRef for leaves
+        int triCount;   // 0 for inner nodes
+    };
+
+    std::vector<Node> nodes;
+    std::vector<int> triRefs;
+    int maxPerLeaf = 4;
+
+    static const int numBins = 16;
+    // bounds the traversal stack, deeper nodes are kept as leaves
+    static const int maxDepth = 63;
+
+    // per-triangle data only needed while building, in buildArena
+    std::span<AABB> triBounds;
+    std::span<glm::vec3> triCentroids;
+
+    // Sah: binned SAH top-down, the best trees for static geometry.
+    // Linear: LBVH (Karras 2012), a Morton code sort and one pass over the
+    // sorted codes, much cheaper for geometry rebuilt whenever it moves or deforms
+    enum class BuildMode
+    {
+        Sah,
+        Linear
+    };
+    BuildMode buildMode = BuildMode::Sah;
+    // Morton code length for the linear build, 30 or 63; longer codes keep
+    // small triangles apart in large scenes
+    int mortonBits = 30;
+
+    // Full: the binary nodes above, 32 bytes each. Quantized8/16: after the build
+    // the tree is collapsed into 4-wide nodes with child boxes in 8 or 16 bits
+    // (see WideBvh.h) and the binary nodes are dropped; queries run on the wide tree
+    enum class NodeFormat
+    {
+        Full,
+        Quantized8,
+        Quantized16
+    };
+    NodeFormat nodeFormat = NodeFormat::Full;
+    WideBvh<uint8_t> wide8;
+    WideBvh<uint16_t> wide16;
+
+    Bvh(BuildMode mode = BuildMode::Sah, NodeFormat format = NodeFormat::Full) : buildMode(mode), nodeFormat(format) {}
+
+    void Build(const std::vector<Vertex> & vList, const std::vector<unsigned int> & tIdxList, glm::mat4 mat) override
+    {
+        Spatial::Build(vList, tIdxList, mat);
+
+        int numTris = (int)triIdxList.size() / 3;
+        nodes.clear();
+        triRefs.clear();
+        triRefs.reserve(numTris);
+        triBounds = buildArena.Alloc<AABB>(numTris);
+        triCentroids = buildArena.Alloc<glm::vec3>(numTris);
+
+        // a binary tree over n leaves never needs more than 2n - 1 nodes
+        nodes.reserve(std::max(1, 2 * numTris - 1));
+        if (buildMode == BuildMode::Linear)
+            BuildLinear(numTris);
+        else
+            BuildSah();
+
+        wide8.nodes.clear();
+        wide16.nodes.clear();
+        if (nodeFormat != NodeFormat::Full)
+        {
+            // wide leaves count their triangles in 16 bits
+            SplitLargeLeaves(UINT16_MAX);
+            if (nodeFormat == NodeFormat::Quantized8)
+                wide8.Collapse(nodes);
+            else
+                wide16.Collapse(nodes);
+            nodes = std::vector<Node>();
+        }
+
+        triBounds = {};
+        triCentroids = {};
+    }
+
+    void BuildSah()
+    {
+        for (int i = 0; i < (int)triList.size(); i++)
+            Insert(i);
+
+        nodes.push_back({bbox, 0, (int)triRefs.size()});
+        UpdateNodeBounds(0);
+
+        // (node, depth) pairs still to be split
+        std::pmr::vector<std::pair<int, int>> todo({{0, 0}}, &buildArena);
+        while (!todo.empty())
+        {
+            auto [n, depth] = todo.back();
+            todo.pop_back();
+            if (depth < maxDepth && Subdivide(n))
+            {
+                todo.push_back({nodes[n].leftFirst, depth + 1});
+                todo.push_back({nodes[n].leftFirst + 1, depth + 1});
+            }
+        }
+    }
+
+    // with the triangles sorted by Morton code, inner node i of the n - 1 covers a
+    // range that starts or ends at i and splits where the range's common code
+    // prefix ends; every node finds its range on its own, so this runs in parallel
+    void BuildLinear(int numTris)
+    {
+        if (numTris == 0)
+            return;
+
+        ThreadPool &pool = ThreadPool::Global();
+        std::span<uint64_t> keys = buildArena.Alloc<uint64_t>(numTris);
+        triRefs.resize(numTris);
+        int bitsPerAxis = mortonBits > 30 ? 21 : 10;
+        pool.ParallelFor(numTris, 4096, [&](int begin, int end) {
+            for (int i = begin; i < end; i++)
+            {
+                Triangle t = getTriangle(i);
+                triBounds[i].min = glm::min(t.v0, glm::min(t.v1, t.v2));
+                triBounds[i].max = glm::max(t.v0, glm::max(t.v1, t.v2));
+                triCentroids[i] = (t.v0 + t.v1 + t.v2) / 3.0f;
+                keys[i] = MortonCode(triCentroids[i], bbox, bitsPerAxis);
+                triRefs[i] = i;
+            }
+        });
+        RadixSort(keys, triRefs, buildArena);
+
+        // common prefix length of sorted codes i and j, -1 outside the array;
+        // equal codes are told apart by their positions
+        auto delta = [&](int i, int j) {
+            if (j < 0 || j >= numTris)
+                return -1;
+            uint64_t diff = keys[i] ^ keys[j];
+            return diff ? std::countl_zero(diff) : 64 + std::countl_zero((uint32_t)(i ^ j));
+        };
+
+        // last index of the left half of every inner node
+        std::span<int> splits = buildArena.Alloc<int>(numTris - 1);
+        pool.ParallelFor(numTris - 1, 1024, [&](int begin, int end) {
+            for (int i = begin; i < end; i++)
+            {
+                // the range reaches towards the neighbour sharing the longer prefix
+                int d = delta(i, i + 1) > delta(i, i - 1) ? 1 : -1;
+                int deltaMin = delta(i, i - d);
+                int lenMax = 2;
+                while (delta(i, i + lenMax * d) > deltaMin)
+                    lenMax *= 2;
+                int len = 0;
+                for (int step = lenMax / 2; step > 0; step /= 2)
+                    if (delta(i, i + (len + step) * d) > deltaMin)
+                        len += step;
+
+                // furthest element still sharing more than the whole range does with i
+                int deltaNode = delta(i, i + len * d);
+                int s = 0;
+                int step = len;
+                do
+                {
+                    step = (step + 1) / 2;
+                    if (delta(i, i + (s + step) * d) > deltaNode)
+                        s += step;
+                } while (step > 1);
+                splits[i] = i + s * d + std::min(d, 0);
+            }
+        });
+
+        // emit top-down so the two children of a node sit next to each other;
+        // the left half [first, split] is inner node split, the right one split + 1
+        struct Range
+        {
+            int node, inner, first, last, depth;
+        };
+        nodes.push_back({{}, 0, numTris});
+        std::pmr::vector<Range> todo({{0, 0, 0, numTris - 1, 0}}, &buildArena);
+        while (!todo.empty())
+        {
+            Range r = todo.back();
+            todo.pop_back();
+            int count = r.last - r.first + 1;
+            if (count <= maxPerLeaf || r.depth >= maxDepth)
+            {
+                nodes[r.node] = {{}, r.first, count};
+                continue;
+            }
+
+            int split = splits[r.inner];
+            int left = (int)nodes.size();
+            nodes.push_back({});
+            nodes.push_back({});
+            nodes[r.node] = {{}, left, 0};
+            todo.push_back({left, split, r.first, split, r.depth + 1});
+            todo.push_back({left + 1, split + 1, split + 1, r.last, r.depth + 1});
+        }
+
+        // children always come after their parent, so one backwards pass fits the inner boxes
+        int numNodes = (int)nodes.size();
+        pool.ParallelFor(numNodes, 1024, [&](int begin, int end) {
+            for (int n = begin; n < end; n++)
+                if (nodes[n].triCount > 0)
+                    UpdateNodeBounds(n);
+        });
+        for (int n = numNodes - 1; n >= 0; n--)
+        {
+            Node &node = nodes[n];
+            if (node.triCount > 0)
+                continue;
+            const AABB &a = nodes[node.leftFirst].box;
+            const AABB &b = nodes[node.leftFirst + 1].box;
+            node.box = {glm::min(a.min, b.min), glm::max(a.max, b.max)};
+        }
+    }
+
+    // halves leaves holding more than maxCount triangles, only happens when
+    // many triangles share one centroid
+    void SplitLargeLeaves(int maxCount)
+    {
+        for (int n = 0; n < (int)nodes.size(); n++)
+        {
+            if (nodes[n].triCount <= maxCount)
+                continue;
+            int first = nodes[n].leftFirst, half = nodes[n].triCount / 2;
+            int left = (int)nodes.size();
+            nodes.push_back({{}, first, half});
+            nodes.push_back({{}, first + half, nodes[n].triCount - half});
+            UpdateNodeBounds(left);
+            UpdateNodeBounds(left + 1);
+            nodes[n].leftFirst = left;
+            nodes[n].triCount = 0;
+        }
+    }
+
+    void UpdateNodeBounds(int n)
+    {
+        Node &node = nodes[n];
+        node.box = {glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX)};
+        for (int i = node.leftFirst; i < node.leftFirst + node.triCount; i++)
+        {
+            const AABB &b = triBounds[triRefs[i]];
+            node.box.min = glm::min(node.box.min, b.min);
+            node.box.max = glm::max(node.box.max, b.max);
+        }
+    }
+
+    static float Area(const AABB &b)
+    {
+        glm::vec3 e = b.max - b.min;
+        return e.x * e.y + e.y * e.z + e.z * e.x;
+    }
+
+    // binned SAH split, returns false when the node stays a leaf
+    bool Subdivide(int n)
+    {
+        Node node = nodes[n];
+        if (node.triCount <= 2)
+            return false;
+
+        glm::vec3 cMin(FLT_MAX), cMax(-FLT_MAX);
+        for (int i = node.leftFirst; i < node.leftFirst + node.triCount; i++)
+        {
+            cMin = glm::min(cMin, triCentroids[triRefs[i]]);
+            cMax = glm::max(cMax, triCentroids[triRefs[i]]);
+        }
+
+        float bestCost = FLT_MAX;
+        int bestAxis = -1, bestSplit = 0;
+
+        for (int axis = 0; axis < 3; axis++)
+        {
+            float extent = cMax[axis] - cMin[axis];
+            if (extent <= 0.0f)
+                continue;
+
+            AABB binBox[numBins];
+            int binCount[numBins] = {0};
+            for (int b = 0; b < numBins; b++)
+                binBox[b] = {glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX)};
+
+            float scale = numBins / extent;
+            for (int i = node.leftFirst; i < node.leftFirst + node.triCount; i++)
+            {
+                int triIdx = triRefs[i];
+                int b = std::min(numBins - 1, (int)((triCentroids[triIdx][axis] - cMin[axis]) * scale));
+                binCount[b]++;
+                binBox[b].min = glm::min(binBox[b].min, triBounds[triIdx].min);
+                binBox[b].max = glm::max(binBox[b].max, triBounds[triIdx].max);
+            }
+
+            // sweep from both sides to get the cost of every plane between bins
+            float leftArea[numBins - 1], rightArea[numBins - 1];
+            int leftCount[numBins - 1], rightCount[numBins - 1];
+            AABB leftBox = {glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX)};
+            AABB rightBox = leftBox;
+            int leftSum = 0, rightSum = 0;
+            for (int i = 0; i < numBins - 1; i++)
+            {
+                leftSum += binCount[i];
+                leftCount[i] = leftSum;
+                leftBox.min = glm::min(leftBox.min, binBox[i].min);
+                leftBox.max = glm::max(leftBox.max, binBox[i].max);
+                leftArea[i] = leftSum > 0 ? Area(leftBox) : 0.0f;
+
+                rightSum += binCount[numBins - 1 - i];
+                rightCount[numBins - 2 - i] = rightSum;
+                rightBox.min = glm::min(rightBox.min, binBox[numBins - 1 - i].min);
+                rightBox.max = glm::max(rightBox.max, binBox[numBins - 1 - i].max);
+                rightArea[numBins - 2 - i] = rightSum > 0 ? Area(rightBox) : 0.0f;
+            }
+
+            for (int i = 0; i < numBins - 1; i++)
+            {
+                float cost = leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i];
+                if (leftCount[i] > 0 && rightCount[i] > 0 && cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestSplit = i;
+                }
+            }
+        }
+
+        // splitting has to beat intersecting every triangle of the node
+        float leafCost = node.triCount * Area(node.box);
+        if (bestAxis < 0 || (bestCost >= leafCost && node.triCount <= maxPerLeaf))
+            return false;
+
+        // partition triRefs around the chosen plane, using the same binning as above
+        float scale = numBins / (cMax[bestAxis] - cMin[bestAxis]);
+        int i = node.leftFirst;
+        int j = node.leftFirst + node.triCount - 1;
+        while (i <= j)
+        {
+            int b = std::min(numBins - 1, (int)((triCentroids[triRefs[i]][bestAxis] - cMin[bestAxis]) * scale));
+            if (b <= bestSplit)
+                i++;
+            else
+                std::swap(triRefs[i], triRefs[j--]);
+        }
+
+        int leftCount = i - node.leftFirst;
+        if (leftCount == 0 || leftCount == node.triCount)
+            return false;
+
+        int left = (int)nodes.size();
+        nodes.push_back({{}, node.leftFirst, leftCount});
+        nodes.push_back({{}, i, node.triCount - leftCount});
+        UpdateNodeBounds(left);
+        UpdateNodeBounds(left + 1);
+
+        nodes[n].leftFirst = left;
+        nodes[n].triCount = 0;
+        return true;
+    }
+
+    bool Raycast(const Ray &ray, HitInfo &outHit) const override
+    {
+        if (nodeFormat == NodeFormat::Quantized8)
+            return wide8.Raycast(*this, triRefs, ray, outHit);
+        if (nodeFormat == NodeFormat::Quantized16)
+            return wide16.Raycast(*this, triRefs, ray, outHit);
+        if (nodes.empty())
+            return false;
+
+        glm::vec3 invDir = 1.0f / ray.dir;
+        WatertightRay wray(ray);
+        HitInfo best = {FLT_MAX, -1};
+
+        int stack[64];
+        int sp = 0;
+        float tNode;
+        if (RaySlab(ray.origin, invDir, nodes[0].box.min, nodes[0].box.max, best.t, tNode))
+            stack[sp++] = 0;
+
+        while (sp > 0)
+        {
+            const Node &node = nodes[stack[--sp]];
+            if (node.triCount > 0)
+            {
+                for (int i = node.leftFirst; i < node.leftFirst + node.triCount; i++)
+                {
+                    float t;
+                    if (RayTriangle(wray, getPackedTriangle(triRefs[i]), best.t, t))
+                        best = {t, triRefs[i]};
+                }
+                continue;
+            }
+
+            // push the far child first so the near one is visited next
+            int near = node.leftFirst, far = node.leftFirst + 1;
+            float tNear, tFar;
+            bool hitNear = RaySlab(ray.origin, invDir, nodes[near].box.min, nodes[near].box.max, best.t, tNear);
+            bool hitFar = RaySlab(ray.origin, invDir, nodes[far].box.min, nodes[far].box.max, best.t, tFar);
+            if (hitNear && hitFar && tFar < tNear)
+            {
+                std::swap(near, far);
+                std::swap(tNear, tFar);
+            }
+            if (hitFar)
+                stack[sp++] = far;
+            if (hitNear)
+                stack[sp++] = near;
+        }
+
+        if (best.triIndex < 0)
+            return false;
+        outHit = best;
+        return true;
+    }
+
+    bool Occluded(const Ray &ray, float tMax) const override
+    {
+        if (nodeFormat == NodeFormat::Quantized8)
+            return wide8.Occluded(*this, triRefs, ray, tMax);
+        if (nodeFormat == NodeFormat::Quantized16)
+            return wide16.Occluded(*this, triRefs, ray, tMax);
+        if (nodes.empty())
+            return false;
+
+        glm::vec3 invDir = 1.0f / ray.dir;
+        WatertightRay wray(ray);
+
+        // no child ordering, any hit ends the search
+        int stack[64];
+        int sp = 0;
+        stack[sp++] = 0;
+
+        while (sp > 0)
+        {
+            const Node &node = nodes[stack[--sp]];
+            float tNode;
+            if (!RaySlab(ray.origin, invDir, node.box.min, node.box.max, tMax, tNode))
+                continue;
+
+            if (node.triCount > 0)
+            {
+                for (int i = node.leftFirst; i < node.leftFirst + node.triCount; i++)
+                {
+                    float t;
+                    if (RayTriangle(wray, getPackedTriangle(triRefs[i]), tMax, t))
+                        return true;
+                }
+                continue;
+            }
+
+            stack[sp++] = node.leftFirst + 1;
+            stack[sp++] = node.leftFirst;
+        }
+        return false;
+    }
+
+    void RaycastPacket(const Ray *rays, int count, HitInfo *outHits) const override
+    {
+        TracePackets(*this, rays, count, outHits, [this](RayPacket &p) { TracePacket(p); });
+    }
+
+    // one traversal for the whole packet, a node is entered while any lane still needs it
+    void TracePacket(RayPacket &p) const
+    {
+        if (nodeFormat == NodeFormat::Quantized8)
+            return wide8.TracePacket(*this, triRefs, p);
+        if (nodeFormat == NodeFormat::Quantized16)
+            return wide16.TracePacket(*this, triRefs, p);
+        if (nodes.empty())
+            return;
+
+        int octant = p.Octant();
+        int stack[64];
+        int sp = 0;
+        stack[sp++] = 0;
+
+        while (sp > 0)
+        {
+            const Node &node = nodes[stack[--sp]];
+            if (!PacketSlab(p, node.box))
+                continue;
+
+            if (node.triCount > 0)
+            {
+                for (int i = node.leftFirst; i < node.leftFirst + node.triCount; i++)
+                    PacketTriangle(p, getPackedTriangle(triRefs[i]), triRefs[i]);
+                continue;
+            }
+
+            // order the children along the axis that separates them best,
+            // all lanes share the direction octant so one order fits them all
+            int near = node.leftFirst, far = node.leftFirst + 1;
+            glm::vec3 d = (nodes[far].box.min + nodes[far].box.max) - (nodes[near].box.min + nodes[near].box.max);
+            int axis = 0;
+            if (fabs(d.y) > fabs(d[axis])) axis = 1;
+            if (fabs(d.z) > fabs(d[axis])) axis = 2;
+            if ((d[axis] > 0.0f) == ((octant >> axis) & 1))
+                std::swap(near, far);
+
+            stack[sp++] = far;
+            stack[sp++] = near;
+        }
+    }
+
+    void QueryAABB(const AABB &box, std::vector<int> &out) const override
+    {
+        if (nodeFormat != NodeFormat::Full)
+        {
+            auto leaf = [&](int first, int count) {
+                out.insert(out.end(), triRefs.begin() + first, triRefs.begin() + first + count);
+                return true;
+            };
+            if (nodeFormat == NodeFormat::Quantized8)
+                wide8.ForEachLeaf(box, leaf);
+            else
+                wide16.ForEachLeaf(box, leaf);
+            return;
+        }
+        if (nodes.empty() || !AABBIntersects(box, nodes[0].box))
+            return;
+
+        int stack[64];
+        int sp = 0;
+        stack[sp++] = 0;
+
+        while (sp > 0)
+        {
+            const Node &node = nodes[stack[--sp]];
+            if (node.triCount > 0)
+            {
+                out.insert(out.end(), triRefs.begin() + node.leftFirst, triRefs.begin() + node.leftFirst + node.triCount);
+                continue;
+            }
+
+            for (int c = node.leftFirst; c <= node.leftFirst + 1; c++)
+                if (AABBIntersects(box, nodes[c].box))
+                    stack[sp++] = c;
+        }
+    }
+
+    bool VisitOverlaps(const AABB &box, OverlapFn fn, void *ctx) const override
+    {
+        if (nodeFormat != NodeFormat::Full)
+        {
+            auto leaf = [&](int first, int count) {
+                for (int i = first; i < first + count; i++)
+                    if (TriangleAABB(getTriangle(triRefs[i]), box) && !fn(ctx, triRefs[i]))
+                        return false;
+                return true;
+            };
+            if (nodeFormat == NodeFormat::Quantized8)
+                return wide8.ForEachLeaf(box, leaf);
+            return wide16.ForEachLeaf(box, leaf);
+        }
+        if (nodes.empty() || !AABBIntersects(box, nodes[0].box))
+            return true;
+
+        int stack[64];
+        int sp = 0;
+        stack[sp++] = 0;
+
+        while (sp > 0)
+        {
+            const Node &node = nodes[stack[--sp]];
+            if (node.triCount > 0)
+            {
+                // every triangle sits in exactly one leaf, so no duplicates here
+                for (int i = node.leftFirst; i < node.leftFirst + node.triCount; i++)
+                    if (TriangleAABB(getTriangle(triRefs[i]), box) && !fn(ctx, triRefs[i]))
+                        return false;
+                continue;
+            }
+
+            for (int c = node.leftFirst; c <= node.leftFirst + 1; c++)
+                if (AABBIntersects(box, nodes[c].box))
+                    stack[sp++] = c;
+        }
+        return true;
+    }
+
+    // leaf triangles lie within their node's box, so a node inside the
+    // frustum hands out its whole subtree without further tests
+    bool QueryFrustum(const Frustum &f, OverlapFn fn, void *ctx) const override
+    {
+        auto leaf = [&](int first, int count, bool bInside) {
+            for (int i = first; i < first + count; i++)
+                if ((bInside || FrustumTriangle(f, getTriangle(triRefs[i]))) && !fn(ctx, triRefs[i]))
+                    return false;
+            return true;
+        };
+        if (nodeFormat == NodeFormat::Quantized8)
+            return wide8.ForEachLeafInFrustum(f, leaf);
+        if (nodeFormat == NodeFormat::Quantized16)
+            return wide16.ForEachLeafInFrustum(f, leaf);
+        if (nodes.empty())
+            return true;
+        FrustumSide rootSide = FrustumAABB(f, nodes[0].box);
+        if (rootSide == FrustumSide::Outside)
+            return true;
+
+        int stack[64];
+        bool stackInside[64];
+        int sp = 0;
+        stack[sp] = 0;
+        stackInside[sp++] = rootSide == FrustumSide::Inside;
+
+        while (sp > 0)
+        {
+            sp--;
+            const Node &node = nodes[stack[sp]];
+            bool bInside = stackInside[sp];
+            if (node.triCount > 0)
+            {
+                if (!leaf(node.leftFirst, node.triCount, bInside))
+                    return false;
+                continue;
+            }
+
+            for (int c = node.leftFirst; c <= node.leftFirst + 1; c++)
+            {
+                FrustumSide side = bInside ? FrustumSide::Inside : FrustumAABB(f, nodes[c].box);
+                if (side == FrustumSide::Outside)
+                    continue;
+                stack[sp] = c;
+                stackInside[sp++] = side == FrustumSide::Inside;
+            }
+        }
+        return true;
+    }
+
+    // branch and bound, the nearer child is opened first
+    bool ClosestPoint(const glm::vec3 &p, float maxDist, ClosestHit &outHit) const override
+    {
+        ClosestHit best = {glm::vec3(0.0f), maxDist * maxDist, -1};
+        if (nodeFormat == NodeFormat::Quantized8)
+            wide8.ClosestPoint(*this, triRefs, p, best);
+        else if (nodeFormat == NodeFormat::Quantized16)
+            wide16.ClosestPoint(*this, triRefs, p, best);
+        else if (!nodes.empty())
+        {
+            int stack[64];
+            float stackDist[64];
+            int sp = 0;
+            stack[sp] = 0;
+            stackDist[sp++] = PointAABBDist2(p, nodes[0].box);
+
+            while (sp > 0)
+            {
+                sp--;
+                if (stackDist[sp] >= best.dist)
+                    continue;
+                const Node &node = nodes[stack[sp]];
+                if (node.triCount > 0)
+                {
+                    for (int i = node.leftFirst; i < node.leftFirst + node.triCount; i++)
+                        UpdateClosest(p, getTriangle(triRefs[i]), triRefs[i], best);
+                    continue;
+                }
+
+                int near = node.leftFirst, far = node.leftFirst + 1;
+                float dNear = PointAABBDist2(p, nodes[near].box);
+                float dFar = PointAABBDist2(p, nodes[far].box);
+                if (dFar < dNear)
+                {
+                    std::swap(near, far);
+                    std::swap(dNear, dFar);
+                }
+                if (dFar < best.dist)
+                {
+                    stack[sp] = far;
+                    stackDist[sp++] = dFar;
+                }
+                if (dNear < best.dist)
+                {
+                    stack[sp] = near;
+                    stackDist[sp++] = dNear;
+                }
+            }
+        }
+        return FinishClosest(best, outHit);
+    }
+
+    SpatialStats Stats() const override
+    {
+        SpatialStats s = Spatial::Stats();
+        s.type = buildMode == BuildMode::Linear ? "LBVH" : "BVH";
+        if (nodeFormat != NodeFormat::Full)
+            s.type += nodeFormat == NodeFormat::Quantized8 ? " (4-wide, 8-bit)" : " (4-wide, 16-bit)";
+        s.bytes += VectorBytes(nodes) + VectorBytes(triRefs) + VectorBytes(wide8.nodes) + VectorBytes(wide16.nodes);
+
+        if (!wide8.nodes.empty())
+            wide8.AddStats(s, bbox);
+        else if (!wide16.nodes.empty())
+            wide16.AddStats(s, bbox);
+        else if (!nodes.empty())
+        {
+            std::vector<std::pair<int, int>> todo = {{0, 0}};
+            while (!todo.empty())
+            {
+                auto [n, depth] = todo.back();
+                todo.pop_back();
+                const Node &node = nodes[n];
+                if (node.triCount > 0)
+                {
+                    s.AddLeaf(node.box, depth, node.triCount);
+                    continue;
+                }
+                s.AddNode(node.box, depth);
+                todo.push_back({node.leftFirst, depth + 1});
+                todo.push_back({node.leftFirst + 1, depth + 1});
+            }
+        }
+        s.Finish(bbox);
+        return s;
+    }
+
+    std::string CacheParams() const override
+    {
+        return "Bvh mode " + std::to_string((int)buildMode) + " format " + std::to_string((int)nodeFormat) +
+               " maxPerLeaf " + std::to_string(maxPerLeaf) + " bins " + std::to_string(numBins) +
+               " mortonBits " + std::to_string(mortonBits);
+    }
+
+    bool SaveCache(BlobWriter &out) const override
+    {
+        out.WriteVector(nodes);
+        out.WriteVector(triRefs);
+        out.WriteVector(wide8.nodes);
+        out.WriteVector(wide16.nodes);
+        return true;
+    }
+
+    bool LoadCache(BlobReader &in) override
+    {
+        in.ReadVector(nodes);
+        in.ReadVector(triRefs);
+        in.ReadVector(wide8.nodes);
+        in.ReadVector(wide16.nodes);
+        if (!in.ok)
+            return false;
+
+        // every child and triangle range has to lie inside the arrays read
+        int numRefs = (int)triRefs.size();
+        bool bValid = std::all_of(nodes.begin(), nodes.end(), [&](const Node &n) {
+            return n.triCount > 0 ? n.leftFirst >= 0 && n.leftFirst + n.triCount <= numRefs
+                                  : n.leftFirst > 0 && n.leftFirst + 1 < (int)nodes.size();
+        });
+        bValid = bValid && ValidTree() && wide8.ValidRanges(numRefs) && wide16.ValidRanges(numRefs);
+        return bValid && std::all_of(triRefs.begin(), triRefs.end(), [&](int t) { return t >= 0 && t < (int)triList.size(); });
+    }
+
+    // the nodes read from a file form one tree: children after their parent, so
+    // there are no cycles, no node reached twice and no leaf deeper than maxDepth,
+    // which sizes the traversal stacks
+    bool ValidTree() const
+    {
+        if (nodes.empty())
+            return true;
+        std::vector<std::pair<int, int>> todo = {{0, 0}};
+        int visited = 0;
+        while (!todo.empty())
+        {
+            auto [n, depth] = todo.back();
+            todo.pop_back();
+            if (depth > maxDepth || ++visited > (int)nodes.size())
+                return false;
+            if (nodes[n].triCount > 0)
+                continue;
+            if (nodes[n].leftFirst <= n)
+                return false;
+            todo.push_back({nodes[n].leftFirst, depth + 1});
+            todo.push_back({nodes[n].leftFirst + 1, depth + 1});
+        }
+        return true;
+    }
+
+private:
+    // triangles are only collected here, the tree is built top-down once all are known
+    void Insert(int triIdx)
+    {
+        Triangle t = getTriangle(triIdx);
+        triBounds[triIdx].min = glm::min(t.v0, glm::min(t.v1, t.v2));
+        triBounds[triIdx].max = glm::max(t.v0, glm::max(t.v1, t.v2));
+        triCentroids[triIdx] = (t.v0 + t.v1 + t.v2) / 3.0f;
+        triRefs.push_back(triIdx);
+    }
+};
+
+#endif
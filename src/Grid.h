@@ -2,6 +2,100 @@
 #define __GRID_H__
 
 #include "Spatial.h"
+#include "ThreadPool.h"
+#include "SpatialCache.h"
+
+// ------------------ Grid Level ------------------
+// one regular lattice of cells: the whole grid, or the refinement of one crowded cell
+struct GridLevel
+{
+    glm::vec3 origin;
+    glm::vec3 cellSize;
+    glm::ivec3 dims;
+    int firstCell = 0;  // second level only: its first cell in Grid::subStart and subOccupied
+
+    int NumCells() const
+    {
+        return dims.x * dims.y * dims.z;
+    }
+
+    int CellIndex(const glm::ivec3 &cell) const
+    {
+        return cell.x + dims.x * (cell.y + dims.y * cell.z);
+    }
+
+    AABB CellBox(const glm::ivec3 &cell) const
+    {
+        glm::vec3 minB = origin + glm::vec3(cell) * cellSize;
+        // grow a little so triangles exactly on a cell face are kept on both sides
+        glm::vec3 eps = cellSize * 1e-4f;
+        return {minB - eps, minB + cellSize + eps};
+    }
+
+    // clamped in float first, points far outside must not overflow the int conversion
+    glm::ivec3 PosToCell(const glm::vec3 &p) const
+    {
+        glm::vec3 local = (p - origin) / cellSize;
+        return glm::ivec3(glm::clamp(local, glm::vec3(0.0f), glm::vec3(dims - glm::ivec3(1))));
+    }
+
+    // calls visit(cellIdx) for every cell overlapping box, false stops
+    template<class F>
+    bool ForEachCell(const AABB &box, F visit) const
+    {
+        glm::ivec3 lo = PosToCell(box.min);
+        glm::ivec3 hi = PosToCell(box.max);
+        for (int z = lo.z; z <= hi.z; z++)
+            for (int y = lo.y; y <= hi.y; y++)
+                for (int x = lo.x; x <= hi.x; x++)
+                    if (!visit(CellIndex({x, y, z})))
+                        return false;
+        return true;
+    }
+
+    // 3D DDA over the cells the ray crosses from tEnter on, in order, until it leaves
+    // the lattice or passes tExit. visit(cellIdx, t0, t1) gets the part of the ray
+    // inside the cell and returns false to stop the walk. occupancy has a bit for
+    // every cell from firstCell on, cells with a clear bit are stepped over unvisited
+    template<class F>
+    bool Walk(const Ray &ray, float tEnter, float tExit, const std::vector<uint64_t> &occupancy, F visit) const
+    {
+        glm::vec3 p = ray.origin + ray.dir * tEnter;
+        glm::ivec3 cell = PosToCell(p);
+
+        // an axis the ray runs parallel to is never stepped
+        glm::ivec3 step;
+        glm::vec3 tDelta, next;
+        for (int a = 0; a < 3; a++)
+        {
+            step[a] = ray.dir[a] > 0.0f ? 1 : (ray.dir[a] < 0.0f ? -1 : 0);
+            if (step[a] == 0)
+            {
+                tDelta[a] = next[a] = FLT_MAX;
+                continue;
+            }
+            float face = origin[a] + (cell[a] + (step[a] > 0)) * cellSize[a];
+            tDelta[a] = cellSize[a] / std::fabs(ray.dir[a]);
+            next[a] = tEnter + (face - p[a]) / ray.dir[a];
+        }
+
+        float t = tEnter;
+        while (true)
+        {
+            int a = next.x < next.y ? (next.x < next.z ? 0 : 2) : (next.y < next.z ? 1 : 2);
+            int idx = CellIndex(cell);
+            int bit = firstCell + idx;
+            if ((occupancy[bit >> 6] >> (bit & 63) & 1) && !visit(idx, t, std::min(next[a], tExit)))
+                return false;
+
+            cell[a] += step[a];
+            if (cell[a] < 0 || cell[a] >= dims[a] || next[a] >= tExit)
+                return true;
+            t = next[a];
+            next[a] += tDelta[a];
+        }
+    }
+};
 
 // ------------------ Uniform Grid ------------------
 class Grid : public Spatial
@@ -10,105 +104,421 @@ public:
     glm::ivec3 dims;
 
     glm::vec3 cellSize;
-    std::vector<std::vector<int>> cells;
 
-    Grid(glm::ivec3 dims = {16, 16, 16}) : dims(dims) {}
+    // dims of (0, 0, 0) are derived from the triangle count and the box shape at
+    // build time, about density cells per triangle (Cleary and Wyvill)
+    bool bAdaptive;
+    float density = 2.0f;
+
+    // optional second level: a top cell holding more than maxCellTris triangles
+    // gets a small grid of its own, with the same density
+    bool bTwoLevel;
+    int maxCellTris = 16;
+
+    // compressed cell storage: the triangles of cell i are
+    // cellTris[cellStart[i]] .. cellTris[cellStart[i + 1] - 1]
+    std::vector<int> cellStart;
+    std::vector<int> cellTris;
+
+    // second level: cellSub[i] is the sub grid of top cell i, or -1 (empty when no
+    // cell is refined). A refined cell has no list of its own, its sub cells are
+    // stored like the top cells, in subStart / subTris from the sub grid's firstCell
+    std::vector<int> cellSub;
+    std::vector<GridLevel> subGrids;
+    std::vector<int> subStart;
+    std::vector<int> subTris;
+
+    // one bit per top cell and per sub cell, set when it holds anything (a refined
+    // top cell always does), so rays cross empty space without reading any list
+    std::vector<uint64_t> occupied;
+    std::vector<uint64_t> subOccupied;
+
+    // (cell, triangle) pairs and per-cell counts of each build chunk, only valid
+    // while building; chunk c keeps its pairs in task arena c, the counts are in
+    // buildArena
+    std::vector<std::pmr::vector<glm::ivec2>> chunkRefs;
+    std::span<int> chunkCounts;     // chunk c, cell i at c * numCells + i
+    // the same pairs for every sub grid, in the task arena of its group
+    std::vector<std::pmr::vector<glm::ivec2>> subRefs;
+
+    Grid(glm::ivec3 dims = glm::ivec3(0), bool bTwoLevel = false)
+        : dims(dims), bAdaptive(glm::any(glm::lessThanEqual(dims, glm::ivec3(0)))), bTwoLevel(bTwoLevel) {}
+
+    // Cleary-style resolution: about density * numTris cells, as close to cubes as
+    // the box allows; an axis much thinner than the others keeps a single layer
+    static glm::ivec3 CellDims(const glm::vec3 &extent, int numTris, float density)
+    {
+        const int maxDim = 256;
+        glm::ivec3 out(1);
+        float maxExtent = std::max(extent.x, std::max(extent.y, extent.z));
+        if (numTris <= 0 || !(maxExtent > 0.0f))
+            return out;
+
+        float volume = 1.0f;
+        int numAxes = 0;
+        for (int a = 0; a < 3; a++)
+            if (extent[a] > maxExtent * 0.01f)
+            {
+                volume *= extent[a];
+                numAxes++;
+            }
+        float side = std::pow(volume / (density * numTris), 1.0f / numAxes);
+        for (int a = 0; a < 3; a++)
+            if (extent[a] > maxExtent * 0.01f)
+                out[a] = std::clamp((int)std::ceil(extent[a] / side), 1, maxDim);
+        return out;
+    }
+
+    GridLevel Top() const
+    {
+        return {bbox.min, cellSize, dims, 0};
+    }
 
-    void Build(const std::vector<Vertex> & vList, const std::vector<unsigned int> & tIdxList, glm::mat4 mat) 
+    void Build(const std::vector<Vertex> & vList, const std::vector<unsigned int> & tIdxList, glm::mat4 mat)
     {
         Spatial::Build(vList, tIdxList, mat);
 
-        cellSize = (bbox.max - bbox.min) / glm::vec3(dims);
+        glm::vec3 extent = bbox.max - bbox.min;
+        if (bAdaptive)
+            dims = CellDims(extent, (int)triList.size(), density);
 
-        // init cell grid
-        int size = dims.x * dims.y * dims.z;
-        cells = std::vector<std::vector<int>>(size);
+        // a flat box still gets cells of some thickness, the walk divides by it
+        float maxExtent = std::max(extent.x, std::max(extent.y, extent.z));
+        cellSize = glm::max(extent, glm::vec3(maxExtent * 1e-6f + FLT_MIN)) / glm::vec3(dims);
+
+        GridLevel top = Top();
+        int size = top.NumCells();
+        int numTris = (int)triList.size();
+        ThreadPool &pool = ThreadPool::Global();
+
+        // pass 1: every chunk of triangles is binned on its own, with its own counts.
+        // Those are a full row of cells per chunk, so the rows are capped at a few ints
+        // per triangle: a grid much finer than the mesh bins in fewer chunks instead of
+        // holding cells x threads mostly-zero counts
+        const int minChunkTris = 1024;
+        const int maxCountsPerTri = 8;
+        int numChunks = std::clamp(numTris / minChunkTris, 1, pool.Size());
+        numChunks = std::min(numChunks, (int)std::max(1LL, (long long)maxCountsPerTri * numTris / size));
+        ResetTaskArenas(numChunks);
+        chunkRefs.clear();
+        for (int c = 0; c < numChunks; c++)
+            chunkRefs.emplace_back(&taskArenas[c]);
+        chunkCounts = buildArena.Alloc<int>((size_t)numChunks * size);
+        std::fill(chunkCounts.begin(), chunkCounts.end(), 0);
+        pool.ParallelFor(numChunks, 1, [&](int begin, int end) {
+            for (int c = begin; c < end; c++)
+            {
+                int first = (int)((long long)numTris * c / numChunks);
+                int last = (int)((long long)numTris * (c + 1) / numChunks);
+                for (int triIdx = first; triIdx < last; triIdx++)
+                    Bin(top, triIdx, chunkRefs[c], &chunkCounts[(size_t)c * size]);
+            }
+        });
+
+        // exclusive prefix sum over (cell, chunk), in blocks of cells: block totals
+        // in parallel, a short serial scan over the blocks, then the offsets in parallel.
+        // chunkCounts becomes the write position of every chunk in every cell
+        cellStart.resize(size + 1);
+        int numBlocks = std::min(size, pool.Size() * 4);
+        std::span<int> blockStart = buildArena.Alloc<int>(numBlocks + 1);
+        blockStart[0] = 0;
+        auto blockCells = [&](int b, int &lo, int &hi) {
+            lo = (int)((long long)size * b / numBlocks);
+            hi = (int)((long long)size * (b + 1) / numBlocks);
+        };
+        pool.ParallelFor(numBlocks, 1, [&](int begin, int end) {
+            for (int b = begin; b < end; b++)
+            {
+                int lo, hi, sum = 0;
+                blockCells(b, lo, hi);
+                for (int c = 0; c < numChunks; c++)
+                    for (int i = lo; i < hi; i++)
+                        sum += chunkCounts[(size_t)c * size + i];
+                blockStart[b + 1] = sum;
+            }
+        });
+        for (int b = 0; b < numBlocks; b++)
+            blockStart[b + 1] += blockStart[b];
+
+        pool.ParallelFor(numBlocks, 1, [&](int begin, int end) {
+            for (int b = begin; b < end; b++)
+            {
+                int lo, hi;
+                blockCells(b, lo, hi);
+                int sum = blockStart[b];
+                for (int i = lo; i < hi; i++)
+                {
+                    cellStart[i] = sum;
+                    for (int c = 0; c < numChunks; c++)
+                    {
+                        int &count = chunkCounts[(size_t)c * size + i];
+                        int n = count;
+                        count = sum;
+                        sum += n;
+                    }
+                }
+            }
+        });
+        cellStart[size] = blockStart[numBlocks];
+
+        // pass 2: every chunk writes its triangle indices, in the same order a serial build would
+        cellTris.resize(cellStart[size]);
+        pool.ParallelFor(numChunks, 1, [&](int begin, int end) {
+            for (int c = begin; c < end; c++)
+            {
+                int *pos = &chunkCounts[(size_t)c * size];
+                for (const glm::ivec2 &ref : chunkRefs[c])
+                    cellTris[pos[ref.x]++] = ref.y;
+            }
+        });
+
+        chunkRefs.clear();
+        chunkCounts = {};
+
+        cellSub.clear();
+        subGrids.clear();
+        subStart.assign(1, 0);
+        subTris.clear();
+        if (bTwoLevel)
+            BuildSubGrids();
+
+        occupied.assign((size + 63) / 64, 0);
+        for (int i = 0; i < size; i++)
+            if (cellStart[i + 1] > cellStart[i] || SubGridOf(i) >= 0)
+                occupied[i >> 6] |= 1ull << (i & 63);
+        int numSubCells = (int)subStart.size() - 1;
+        subOccupied.assign((numSubCells + 63) / 64, 0);
+        for (int i = 0; i < numSubCells; i++)
+            if (subStart[i + 1] > subStart[i])
+                subOccupied[i >> 6] |= 1ull << (i & 63);
+    }
+
+    // refines every crowded top cell: the sub grids are binned in parallel, each
+    // into its own range of sub cells, then the refined cells drop their top lists
+    void BuildSubGrids()
+    {
+        GridLevel top = Top();
+        int size = top.NumCells();
+        std::pmr::vector<int> subCell(&buildArena);    // top cell of every sub grid
+        int numSubCells = 0;
+        cellSub.assign(size, -1);
+        for (int i = 0; i < size; i++)
+        {
+            int count = cellStart[i + 1] - cellStart[i];
+            if (count <= maxCellTris)
+                continue;
+
+            GridLevel sub;
+            sub.dims = CellDims(cellSize, count, density);
+            if (sub.NumCells() == 1)
+                continue;
+            glm::ivec3 cell = {i % dims.x, (i / dims.x) % dims.y, i / (dims.x * dims.y)};
+            sub.origin = bbox.min + glm::vec3(cell) * cellSize;
+            sub.cellSize = cellSize / glm::vec3(sub.dims);
+            sub.firstCell = numSubCells;
+            numSubCells += sub.NumCells();
+
+            cellSub[i] = (int)subGrids.size();
+            subGrids.push_back(sub);
+            subCell.push_back(i);
+        }
+        if (subGrids.empty())
+        {
+            cellSub.clear();
+            return;
+        }
+
+        // counts first, in each sub grid's own range of subStart. The sub grids are
+        // split into a few groups, each binning into the task arena of its own
+        int numSubs = (int)subGrids.size();
+        ThreadPool &pool = ThreadPool::Global();
+        int numGroups = std::min(numSubs, pool.Size() * 4);
+        auto groupSubs = [&](int g, int &lo, int &hi) {
+            lo = (int)((long long)numSubs * g / numGroups);
+            hi = (int)((long long)numSubs * (g + 1) / numGroups);
+        };
+        ResetTaskArenas(numGroups);
+        subRefs.clear();
+        for (int g = 0; g < numGroups; g++)
+        {
+            int lo, hi;
+            groupSubs(g, lo, hi);
+            for (int s = lo; s < hi; s++)
+                subRefs.emplace_back(&taskArenas[g]);
+        }
+        subStart.assign(numSubCells + 1, 0);
+        pool.ParallelFor(numGroups, 1, [&](int begin, int end) {
+            for (int g = begin; g < end; g++)
+            {
+                int lo, hi;
+                groupSubs(g, lo, hi);
+                for (int s = lo; s < hi; s++)
+                {
+                    int c = subCell[s];
+                    for (int i = cellStart[c]; i < cellStart[c + 1]; i++)
+                        Bin(subGrids[s], cellTris[i], subRefs[s], &subStart[subGrids[s].firstCell]);
+                }
+            }
+        });
+
+        int sum = 0;
+        for (int i = 0; i < numSubCells; i++)
+        {
+            int n = subStart[i];
+            subStart[i] = sum;
+            sum += n;
+        }
+        subStart[numSubCells] = sum;
+
+        subTris.resize(sum);
+        pool.ParallelFor(numGroups, 1, [&](int begin, int end) {
+            for (int g = begin; g < end; g++)
+            {
+                int lo, hi;
+                groupSubs(g, lo, hi);
+                for (int s = lo; s < hi; s++)
+                {
+                    const GridLevel &sub = subGrids[s];
+                    std::span<int> pos = taskArenas[g].Alloc<int>(sub.NumCells());
+                    std::copy_n(subStart.begin() + sub.firstCell, sub.NumCells(), pos.begin());
+                    for (const glm::ivec2 &ref : subRefs[s])
+                        subTris[pos[ref.x]++] = ref.y;
+                }
+            }
+        });
+
+        subRefs.clear();
+
+        // compact the top lists in place, every cell only moves towards the front
+        int w = 0;
         for (int i = 0; i < size; i++)
-            cells[i] = std::vector<int>();
+        {
+            int first = cellStart[i], last = cellStart[i + 1];
+            cellStart[i] = w;
+            if (cellSub[i] < 0)
+                for (int k = first; k < last; k++)
+                    cellTris[w++] = cellTris[k];
+        }
+        cellStart[size] = w;
+        // no shrink_to_fit, the next build reuses the space
+        cellTris.resize(w);
+    }
 
-        InsertTriangles();   
+    AABB CellBox(const glm::ivec3 &cell) const
+    {
+        return Top().CellBox(cell);
     }
 
     glm::ivec3 PosToCell(const glm::vec3 &p) const
     {
-        glm::vec3 local = (p - bbox.min) / cellSize;
-        return glm::clamp(glm::ivec3(local), glm::ivec3(0), dims - glm::ivec3(1));
+        return Top().PosToCell(p);
     }
 
-    void Insert(int triIdx) override
+    int SubGridOf(int cellIdx) const
+    {
+        return cellSub.empty() ? -1 : cellSub[cellIdx];
+    }
+
+    // the triangles of top cell cellIdx; a refined cell only hands out those of
+    // its sub cells overlapping box. fn returns false to stop
+    template<class F>
+    bool VisitCell(int cellIdx, const AABB &box, F fn) const
+    {
+        int s = SubGridOf(cellIdx);
+        if (s < 0)
+        {
+            for (int i = cellStart[cellIdx]; i < cellStart[cellIdx + 1]; i++)
+                if (!fn(cellTris[i]))
+                    return false;
+            return true;
+        }
+
+        const GridLevel &sub = subGrids[s];
+        return sub.ForEachCell(box, [&](int local) {
+            int c = sub.firstCell + local;
+            for (int i = subStart[c]; i < subStart[c + 1]; i++)
+                if (!fn(subTris[i]))
+                    return false;
+            return true;
+        });
+    }
+
+    // the same along a ray: a refined cell is walked between t0 and t1, up to the
+    // sub cell holding tDone, the closest hit so far
+    template<class F>
+    bool VisitCell(int cellIdx, const Ray &ray, float t0, float t1, const float &tDone, F fn) const
+    {
+        int s = SubGridOf(cellIdx);
+        if (s < 0)
+        {
+            for (int i = cellStart[cellIdx]; i < cellStart[cellIdx + 1]; i++)
+                if (!fn(cellTris[i]))
+                    return false;
+            return true;
+        }
+
+        const GridLevel &sub = subGrids[s];
+        return sub.Walk(ray, t0, t1, subOccupied, [&](int local, float, float s1) {
+            int c = sub.firstCell + local;
+            for (int i = subStart[c]; i < subStart[c + 1]; i++)
+                if (!fn(subTris[i]))
+                    return false;
+            return tDone > s1;
+        });
+    }
+
+    // adds a (cell, triangle) pair and a count for every cell of level the triangle touches
+    void Bin(const GridLevel &level, int triIdx, std::pmr::vector<glm::ivec2> &refs, int *counts) const
     {
         Triangle t = getTriangle(triIdx);
 
         glm::vec3 triMin = glm::min(t.v0, glm::min(t.v1, t.v2));
         glm::vec3 triMax = glm::max(t.v0, glm::max(t.v1, t.v2));
 
-        glm::ivec3 minCell = PosToCell(triMin);
-        glm::ivec3 maxCell = PosToCell(triMax);
+        glm::ivec3 minCell = level.PosToCell(triMin);
+        glm::ivec3 maxCell = level.PosToCell(triMax);
 
+        // the bounding box range is only a candidate set, diagonal triangles miss most of it
+        bool bSingleCell = minCell == maxCell;
+        TriangleSAT sat(t);
         for (int z = minCell.z; z <= maxCell.z; z++)
             for (int y = minCell.y; y <= maxCell.y; y++)
                 for (int x = minCell.x; x <= maxCell.x; x++)
                 {
-                    int idx = x + dims.x * (y + dims.y * z);
-                    cells[idx].push_back(triIdx);
+                    if (!bSingleCell && !sat.Overlaps(level.CellBox({x, y, z})))
+                        continue;
+
+                    int idx = level.CellIndex({x, y, z});
+                    counts[idx]++;
+                    refs.push_back({idx, triIdx});
                 }
     }
 
-    
-    bool Raycast(const Ray &ray, HitInfo &outHit) override
+    bool Raycast(const Ray &ray, HitInfo &outHit) const override
     {
         float tHit;
         if (!RayAABB(ray.origin, ray.dir, bbox.min, bbox.max, tHit))
             return false;
 
-        // 3D DDA
-        glm::vec3 p = ray.origin + ray.dir * std::max(0.0f, tHit);
-        glm::ivec3 cell = PosToCell(p);
-
-        glm::vec3 step = glm::sign(ray.dir);
-        glm::vec3 tDelta = glm::abs(cellSize / ray.dir);
-        glm::vec3 next;
-        next.x = ((cell.x + (step.x > 0)) * cellSize.x + bbox.min.x - p.x) / ray.dir.x;
-        next.y = ((cell.y + (step.y > 0)) * cellSize.y + bbox.min.y - p.y) / ray.dir.y;
-        next.z = ((cell.z + (step.z > 0)) * cellSize.z + bbox.min.z - p.z) / ray.dir.z;
-
+        WatertightRay wray(ray);
         float bestT = FLT_MAX;
         int bestIdx = -1;
 
-        while (cell.x >= 0 && cell.y >= 0 && cell.z >= 0 &&
-               cell.x < dims.x && cell.y < dims.y && cell.z < dims.z)
-        {
-            int idx = cell.x + dims.x * (cell.y + dims.y * cell.z);
-            for (int triIdx : cells[idx]) {
+        // mailbox: a triangle stored in several cells is only tested in the first,
+        // bestT only shrinks so a second test could not change anything
+        OverlapMarks mailbox((int)triList.size());
+        Top().Walk(ray, std::max(0.0f, tHit), FLT_MAX, occupied, [&](int idx, float t0, float t1) {
+            VisitCell(idx, ray, t0, t1, bestT, [&](int triIdx) {
                 float t;
-                Triangle tri = Spatial::getTriangle(triIdx);
-
-                if (RayTriangle(ray, tri, t)) {
-                    if (t < bestT) {
-                        bestT = t;
-                        bestIdx = triIdx;
-                    }
-                }
-            }
-
-            if (next.x < next.y) {
-                if (next.x < next.z) {
-                    cell.x += (int)step.x;
-                    next.x += tDelta.x;
-                } else {
-                    cell.z += (int)step.z;
-                    next.z += tDelta.z;
-                }
-            } else {
-                if (next.y < next.z) {
-                    cell.y += (int)step.y;
-                    next.y += tDelta.y;
-                } else {
-                    cell.z += (int)step.z;
-                    next.z += tDelta.z;
+                if (mailbox.Mark(triIdx) && RayTriangle(wray, getPackedTriangle(triIdx), bestT, t)) {
+                    bestT = t;
+                    bestIdx = triIdx;
                 }
-            }
-        }
+                return true;
+            });
+            // a hit inside this cell is closer than anything in the cells behind it
+            return bestT > t1;
+        });
 
         if (bestIdx >= 0) {
             outHit = {bestT, bestIdx};
@@ -117,22 +527,254 @@ public:
         return false;
     }
 
+    bool Occluded(const Ray &ray, float tMax) const override
+    {
+        float tHit;
+        if (!RayAABB(ray.origin, ray.dir, bbox.min, bbox.max, tHit) || tHit >= tMax)
+            return false;
+
+        // same walk as Raycast, ending at the first hit or once a cell starts past tMax
+        WatertightRay wray(ray);
+        bool bHit = false;
+        OverlapMarks mailbox((int)triList.size());
+        Top().Walk(ray, std::max(0.0f, tHit), tMax, occupied, [&](int idx, float t0, float t1) {
+            return VisitCell(idx, ray, t0, t1, tMax, [&](int triIdx) {
+                float t;
+                bHit = mailbox.Mark(triIdx) && RayTriangle(wray, getPackedTriangle(triIdx), tMax, t);
+                return !bHit;
+            });
+        });
+        return bHit;
+    }
+
     void QueryAABB(const AABB &box, std::vector<int> &out) const override
     {
         if (!AABBIntersects(box, bbox))
             return;
 
-        glm::ivec3 minC = PosToCell(box.min);
-        glm::ivec3 maxC = PosToCell(box.max);
+        // each triangle once, even when it is stored in several cells
+        OverlapMarks marks((int)triList.size());
+        Top().ForEachCell(box, [&](int idx) {
+            return VisitCell(idx, box, [&](int triIdx) {
+                if (marks.Mark(triIdx))
+                    out.push_back(triIdx);
+                return true;
+            });
+        });
+    }
+
+    bool VisitOverlaps(const AABB &box, OverlapFn fn, void *ctx) const override
+    {
+        if (!AABBIntersects(box, bbox))
+            return true;
+
+        // a triangle crossing cells is stored in each of them
+        OverlapMarks marks((int)triList.size());
+        return Top().ForEachCell(box, [&](int idx) {
+            return VisitCell(idx, box, [&](int triIdx) {
+                return !marks.Mark(triIdx) || !TriangleAABB(getTriangle(triIdx), box) || fn(ctx, triIdx);
+            });
+        });
+    }
+
+    bool QueryFrustum(const Frustum &f, OverlapFn fn, void *ctx) const override
+    {
+        if (!AABBIntersects(f.box, bbox))
+            return true;
+
+        OverlapMarks marks((int)triList.size());
+        GridLevel top = Top();
+        return top.ForEachCell(f.box, [&](int idx) {
+            // a cell inside the frustum holds only triangles touching it
+            glm::ivec3 cell = {idx % dims.x, (idx / dims.x) % dims.y, idx / (dims.x * dims.y)};
+            FrustumSide side = FrustumAABB(f, top.CellBox(cell));
+            if (side == FrustumSide::Outside)
+                return true;
+
+            return VisitCell(idx, f.box, [&](int triIdx) {
+                if (!marks.Mark(triIdx))
+                    return true;
+                return !(side == FrustumSide::Inside || FrustumTriangle(f, getTriangle(triIdx))) || fn(ctx, triIdx);
+            });
+        });
+    }
+
+    // searches shells of cells around p's cell, one ring further out at a time,
+    // until a ring cannot hold anything closer than the best point so far
+    bool ClosestPoint(const glm::vec3 &p, float maxDist, ClosestHit &outHit) const override
+    {
+        ClosestHit best = {glm::vec3(0.0f), maxDist * maxDist, -1};
+        if (triList.empty() || PointAABBDist2(p, bbox) >= best.dist)
+            return false;
+
+        OverlapMarks marks((int)triList.size());
+        glm::ivec3 c0 = PosToCell(p);
+        float minCell = std::min(cellSize.x, std::min(cellSize.y, cellSize.z));
+        glm::ivec3 far = glm::max(c0, dims - glm::ivec3(1) - c0);
+        int maxRing = std::max(far.x, std::max(far.y, far.z));
+        glm::vec3 farCorner = glm::max(glm::abs(p - bbox.min), glm::abs(p - bbox.max));
+        float maxReach = glm::length(farCorner);
+
+        for (int k = 0; k <= maxRing; k++)
+        {
+            // every cell of ring k is at least k - 1 whole cells away from p
+            float ringDist = std::max(0, k - 1) * minCell;
+            if (ringDist * ringDist >= best.dist)
+                break;
+
+            // only cells within the best distance so far can help, the search
+            // is over once the inner rings covered all of them
+            float reach = std::min(std::sqrt(best.dist), maxReach);
+            AABB reachBox = {p - glm::vec3(reach), p + glm::vec3(reach)};
+            glm::ivec3 reachLo = PosToCell(reachBox.min);
+            glm::ivec3 reachHi = PosToCell(reachBox.max);
+            if (k > 0 && glm::all(glm::lessThanEqual(c0 - glm::ivec3(k - 1), reachLo)) &&
+                glm::all(glm::greaterThanEqual(c0 + glm::ivec3(k - 1), reachHi)))
+                break;
 
-        for (int z = minC.z; z <= maxC.z; z++)
-            for (int y = minC.y; y <= maxC.y; y++)
-                for (int x = minC.x; x <= maxC.x; x++)
+            glm::ivec3 lo = glm::max(c0 - glm::ivec3(k), reachLo);
+            glm::ivec3 hi = glm::min(c0 + glm::ivec3(k), reachHi);
+            for (int z = lo.z; z <= hi.z; z++)
+                for (int y = lo.y; y <= hi.y; y++)
                 {
-                    int idx = x + dims.x * (y + dims.y * z);
-                    out.insert(out.end(), cells[idx].begin(), cells[idx].end());
+                    // rows inside the shell only have their two end cells on it
+                    bool bShellRow = std::abs(z - c0.z) == k || std::abs(y - c0.y) == k;
+                    for (int x = lo.x; x <= hi.x; x++)
+                    {
+                        if (!bShellRow && std::abs(x - c0.x) < k)
+                        {
+                            x = c0.x + k - 1;
+                            continue;
+                        }
+                        if (PointAABBDist2(p, CellBox({x, y, z})) >= best.dist)
+                            continue;
+
+                        VisitCell(x + dims.x * (y + dims.y * z), reachBox, [&](int triIdx) {
+                            if (marks.Mark(triIdx))
+                                UpdateClosest(p, getTriangle(triIdx), triIdx, best);
+                            return true;
+                        });
+                    }
                 }
+        }
+        return FinishClosest(best, outHit);
+    }
+
+    // every cell is a leaf, a refined cell is a node over the leaves of its sub grid
+    SpatialStats Stats() const override
+    {
+        SpatialStats s = Spatial::Stats();
+        s.type = bTwoLevel ? "Grid (two-level)" : "Grid";
+        s.bytes += VectorBytes(cellStart) + VectorBytes(cellTris) + VectorBytes(cellSub) + VectorBytes(subGrids) +
+                   VectorBytes(subStart) + VectorBytes(subTris) + VectorBytes(occupied) + VectorBytes(subOccupied);
+
+        GridLevel top = Top();
+        for (int i = 0; i < top.NumCells(); i++)
+        {
+            glm::ivec3 cell = {i % dims.x, (i / dims.x) % dims.y, i / (dims.x * dims.y)};
+            AABB box = {top.origin + glm::vec3(cell) * cellSize, top.origin + glm::vec3(cell + 1) * cellSize};
+            int sub = SubGridOf(i);
+            if (sub < 0)
+            {
+                s.AddLeaf(box, 0, cellStart[i + 1] - cellStart[i]);
+                continue;
+            }
+
+            s.AddNode(box, 0);
+            const GridLevel &g = subGrids[sub];
+            for (int k = 0; k < g.NumCells(); k++)
+            {
+                glm::ivec3 c = {k % g.dims.x, (k / g.dims.x) % g.dims.y, k / (g.dims.x * g.dims.y)};
+                int idx = g.firstCell + k;
+                s.AddLeaf({g.origin + glm::vec3(c) * g.cellSize, g.origin + glm::vec3(c + 1) * g.cellSize}, 1,
+                          subStart[idx + 1] - subStart[idx]);
+            }
+        }
+        s.Finish(bbox);
+        return s;
+    }
+
+    // adaptive dims follow from the geometry, which is in the key already
+    std::string CacheParams() const override
+    {
+        glm::ivec3 d = bAdaptive ? glm::ivec3(0) : dims;
+        return "Grid " + std::to_string(d.x) + "x" + std::to_string(d.y) + "x" + std::to_string(d.z) +
+               " density " + std::to_string(density) + " twoLevel " + std::to_string(bTwoLevel) +
+               " maxCellTris " + std::to_string(maxCellTris);
+    }
+
+    bool SaveCache(BlobWriter &out) const override
+    {
+        out.Write(dims);
+        out.Write(cellSize);
+        out.WriteVector(cellStart);
+        out.WriteVector(cellTris);
+        out.WriteVector(cellSub);
+        out.WriteVector(subGrids);
+        out.WriteVector(subStart);
+        out.WriteVector(subTris);
+        out.WriteVector(occupied);
+        out.WriteVector(subOccupied);
+        return true;
+    }
+
+    bool LoadCache(BlobReader &in) override
+    {
+        in.Read(dims);
+        in.Read(cellSize);
+        in.ReadVector(cellStart);
+        in.ReadVector(cellTris);
+        in.ReadVector(cellSub);
+        in.ReadVector(subGrids);
+        in.ReadVector(subStart);
+        in.ReadVector(subTris);
+        in.ReadVector(occupied);
+        in.ReadVector(subOccupied);
+
+        // the lists have to fit the cells and the triangles before any query trusts them;
+        // Build always leaves subStart with its closing entry, even without sub grids
+        if (!in.ok || cellStart.empty() || subStart.empty())
+            return false;
+        int size = (int)cellStart.size() - 1;
+        int numSubCells = (int)subStart.size() - 1;
+        if (CheckedCells(dims, size) != size || (!cellSub.empty() && (int)cellSub.size() != size) ||
+            (int)occupied.size() != (size + 63) / 64 || (int)subOccupied.size() != (numSubCells + 63) / 64)
+            return false;
+
+        // every refined cell names a sub grid, every sub grid's cells lie inside subStart
+        bool bValidSubs = std::all_of(cellSub.begin(), cellSub.end(), [&](int s) {
+            return s >= -1 && s < (int)subGrids.size();
+        });
+        bValidSubs = bValidSubs && std::all_of(subGrids.begin(), subGrids.end(), [&](const GridLevel &sub) {
+            return sub.firstCell >= 0 && sub.firstCell <= numSubCells &&
+                   CheckedCells(sub.dims, numSubCells - sub.firstCell) >= 0;
+        });
+        return bValidSubs && ValidStarts(cellStart, cellTris) && ValidStarts(subStart, subTris) &&
+               ValidRefs(cellTris) && ValidRefs(subTris);
+    }
+
+    // dims.x * dims.y * dims.z, -1 if a dim is not positive or the count exceeds limit;
+    // the partial products stay far below the int64 range
+    static int64_t CheckedCells(const glm::ivec3 &d, int64_t limit)
+    {
+        if (glm::any(glm::lessThanEqual(d, glm::ivec3(0))) || d.x > limit || d.y > limit || d.z > limit)
+            return -1;
+        int64_t xy = (int64_t)d.x * d.y;
+        if (xy > limit || xy * d.z > limit)
+            return -1;
+        return xy * d.z;
+    }
+
+    // offsets of cell lists into refs: non-decreasing from 0 to the end of refs
+    static bool ValidStarts(const std::vector<int> &starts, const std::vector<int> &refs)
+    {
+        return starts.front() == 0 && starts.back() == (int)refs.size() && std::is_sorted(starts.begin(), starts.end());
+    }
+
+    bool ValidRefs(const std::vector<int> &refs) const
+    {
+        return std::all_of(refs.begin(), refs.end(), [&](int t) { return t >= 0 && t < (int)triList.size(); });
     }
 };
 
-#endif __GRID_H__
\ No newline at end of file
+#endif
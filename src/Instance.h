@@ -0,0 +1,208 @@
+#ifndef __INSTANCE_H__
+#define __INSTANCE_H__
+
+#include "Spatial.h"
+
+// ------------------ Instance ------------------
+// One placement of a shared, object-space acceleration structure (the BLAS).
+// Only the model matrix and its inverse are stored per instance, queries are
+// moved into object space and answered by the BLAS.
+class Instance : public Spatial
+{
+public:
+    std::shared_ptr<Spatial> blas;
+    glm::mat4 matInverse;
+
+    Instance(std::shared_ptr<Spatial> blas, glm::mat4 mat) : blas(blas)
+    {
+        SetTransform(mat);
+    }
+
+    // the geometry lives in the shared BLAS, building an instance only places it
+    void Build(const std::vector<Vertex> &, const std::vector<unsigned int> &, glm::mat4 mat) override
+    {
+        SetTransform(mat);
+    }
+
+    // a move never touches the BLAS, only the matrices and the world bounds
+    void SetTransform(const glm::mat4 &mat) override
+    {
+        matModel = mat;
+        matInverse = glm::inverse(mat);
+        ComputeWorldBounds();
+    }
+
+    // world box around the 8 transformed corners of the object-space box
+    static AABB TransformBox(const AABB &box, const glm::mat4 &mat)
+    {
+        AABB out = {glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX)};
+        for (int i = 0; i < 8; i++)
+        {
+            glm::vec3 corner = {
+                (i & 1) ? box.max.x : box.min.x,
+                (i & 2) ? box.max.y : box.min.y,
+                (i & 4) ? box.max.z : box.min.z};
+            corner = glm::vec3(mat * glm::vec4(corner, 1.0f));
+            out.min = glm::min(out.min, corner);
+            out.max = glm::max(out.max, corner);
+        }
+        return out;
+    }
+
+    void ComputeWorldBounds()
+    {
+        bbox = TransformBox(blas->bbox, matModel);
+    }
+
+    // keep the object-space direction normalized so the BLAS sees the usual
+    // scale, len converts its t back to world units
+    Ray ToObject(const Ray &ray, float &len) const
+    {
+        glm::vec3 dir = glm::vec3(matInverse * glm::vec4(ray.dir, 0.0f));
+        len = glm::length(dir);
+        return {glm::vec3(matInverse * glm::vec4(ray.origin, 1.0f)), dir / len};
+    }
+
+    bool Raycast(const Ray &ray, HitInfo &outHit) const override
+    {
+        float len;
+        if (!blas->Raycast(ToObject(ray, len), outHit))
+            return false;
+        outHit.t /= len;
+        return true;
+    }
+
+    // the object-space direction is normalized, so the range scales by len
+    bool Occluded(const Ray &ray, float tMax) const override
+    {
+        float len;
+        Ray local = ToObject(ray, len);
+        return blas->Occluded(local, tMax * len);
+    }
+
+    void RaycastPacket(const Ray *rays, int count, HitInfo *outHits) const override
+    {
+        const int chunk = 64;
+        Ray local[chunk];
+        float len[chunk];
+        for (int first = 0; first < count; first += chunk)
+        {
+            int n = std::min(chunk, count - first);
+            for (int i = 0; i < n; i++)
+                local[i] = ToObject(rays[first + i], len[i]);
+
+            blas->RaycastPacket(local, n, outHits + first);
+            for (int i = 0; i < n; i++)
+                if (outHits[first + i].triIndex >= 0)
+                    outHits[first + i].t /= len[i];
+        }
+    }
+
+    void QueryAABB(const AABB &box, std::vector<int> &out) const override
+    {
+        if (!AABBIntersects(box, bbox))
+            return;
+        blas->QueryAABB(TransformBox(box, matInverse), out);
+    }
+
+    Triangle ToWorld(const Triangle &t) const
+    {
+        return {
+            glm::vec3(matModel * glm::vec4(t.v0, 1.0f)),
+            glm::vec3(matModel * glm::vec4(t.v1, 1.0f)),
+            glm::vec3(matModel * glm::vec4(t.v2, 1.0f))};
+    }
+
+    // the object-space box encloses the world box, so the BLAS returns a superset;
+    // each of those triangles is moved to world space and tested against box itself
+    bool VisitOverlaps(const AABB &box, OverlapFn fn, void *ctx) const override
+    {
+        if (!AABBIntersects(box, bbox))
+            return true;
+
+        return blas->ForEachOverlap(TransformBox(box, matInverse), [&](int triIdx) {
+            return !TriangleAABB(ToWorld(blas->getTriangle(triIdx)), box) || fn(ctx, triIdx);
+        });
+    }
+
+    // planes map exactly under any affine matrix, so the BLAS answers in object space
+    bool QueryFrustum(const Frustum &f, OverlapFn fn, void *ctx) const override
+    {
+        if (FrustumAABB(f, bbox) == FrustumSide::Outside)
+            return true;
+        return blas->QueryFrustum(f.Transformed(matModel, matInverse), fn, ctx);
+    }
+
+    // a scaled sphere is no longer a sphere in object space, so the sweep
+    // runs in world space on the BLAS triangles near the path
+    bool SweepSphere(const glm::vec3 &from, const glm::vec3 &to, float radius, SweepHit &outHit) const override
+    {
+        AABB box = SweepBounds(from, to, radius);
+        if (!AABBIntersects(box, bbox))
+            return false;
+
+        SweepHit best = {1.0f, glm::vec3(0.0f), -1};
+        blas->ForEachOverlap(TransformBox(box, matInverse), [&](int triIdx) {
+            float t;
+            glm::vec3 n;
+            if (SweepSphereTriangle(from, to - from, radius, ToWorld(blas->getTriangle(triIdx)), best.t, t, n))
+                best = {t, n, triIdx};
+        });
+
+        if (best.triIndex < 0)
+            return false;
+        outHit = best;
+        return true;
+    }
+
+    // a rotation, uniform scale and translation keep nearest points nearest, so the
+    // BLAS answers in object space; otherwise the BLAS triangles within reach of p
+    // are moved to world space and measured there
+    bool ClosestPoint(const glm::vec3 &p, float maxDist, ClosestHit &outHit) const override
+    {
+        if (PointAABBDist2(p, bbox) >= maxDist * maxDist)
+            return false;
+
+        glm::mat3 m(matModel);
+        float scale = glm::length(m[0]);
+        bool bSimilar = std::fabs(glm::length(m[1]) - scale) <= 1e-5f * scale &&
+                        std::fabs(glm::length(m[2]) - scale) <= 1e-5f * scale &&
+                        std::fabs(glm::dot(m[0], m[1])) <= 1e-5f * scale * scale &&
+                        std::fabs(glm::dot(m[1], m[2])) <= 1e-5f * scale * scale &&
+                        std::fabs(glm::dot(m[2], m[0])) <= 1e-5f * scale * scale;
+        if (bSimilar && scale > 0.0f)
+        {
+            glm::vec3 local = glm::vec3(matInverse * glm::vec4(p, 1.0f));
+            if (!blas->ClosestPoint(local, maxDist / scale, outHit))
+                return false;
+            outHit.point = glm::vec3(matModel * glm::vec4(outHit.point, 1.0f));
+            outHit.dist *= scale;
+            return true;
+        }
+
+        // the object-space nearest point is some point of the mesh, so its world
+        // distance bounds the search; nothing is further than the farthest corner either
+        glm::vec3 farCorner = glm::max(glm::abs(p - bbox.min), glm::abs(p - bbox.max));
+        float reach = std::min(maxDist, glm::length(farCorner));
+        ClosestHit guess;
+        if (blas->ClosestPoint(glm::vec3(matInverse * glm::vec4(p, 1.0f)), FLT_MAX, guess))
+            reach = std::min(reach, glm::length(glm::vec3(matModel * glm::vec4(guess.point, 1.0f)) - p) * 1.0001f);
+        AABB box = {p - glm::vec3(reach), p + glm::vec3(reach)};
+
+        ClosestHit best = {glm::vec3(0.0f), maxDist * maxDist, -1};
+        blas->ForEachOverlap(TransformBox(box, matInverse), [&](int triIdx) {
+            UpdateClosest(p, ToWorld(blas->getTriangle(triIdx)), triIdx, best);
+        });
+        return FinishClosest(best, outHit);
+    }
+
+    // the BLAS is shared by every instance of the mesh, so are its stats
+    SpatialStats Stats() const override
+    {
+        SpatialStats s = blas->Stats();
+        s.type = "Instance of " + s.type;
+        return s;
+    }
+};
+
+#endif
@@ -0,0 +1,407 @@
+#ifndef __LOOSEOCTREE_H__
+#define __LOOSEOCTREE_H__
+
+#include "Spatial.h"
+
+// ------------------ Loose octree ------------------
+// Octree over the world bounds of whole objects (meshes or Instances), for
+// scenes where many of them move every frame. The box of every node is twice
+// the size of its cell (Ulrich 2000), so where an object goes only depends on
+// its size and center: the deepest level whose cells are at least as large as
+// the object, in the cell holding its center. Adding, removing or moving one
+// object touches a fixed number of levels and nothing else in the tree; the
+// objects of a node are a doubly linked list through their slots.
+// It sits next to Tlas instead of replacing it: the loose boxes overlap, so its
+// queries visit more objects than the tight Tlas tree, while Tlas pays for
+// reinsertion and rotations whenever an object leaves its fat box. The scene
+// part of bench_spatial moves every object every frame and measures both.
+class LooseOctree
+{
+public:
+    struct Node
+    {
+        glm::vec3 center;
+        float halfSize;     // of the cell, the loose box is twice as large
+        int parent;
+        int child[8];       // octant i, bit 0/1/2 for the upper half in x/y/z; -1 if none
+        int firstObject;    // -1 when the node holds none itself
+        int numObjects;     // here and below, an empty node is dropped
+    };
+
+    struct Object
+    {
+        Spatial *spatial;   // null for free ids
+        int node;
+        int prev, next;     // in the list of node
+    };
+
+    // object ids are positions in this list, the id of a removed object is reused
+    std::vector<Object> objects;
+    std::vector<int> freeIds;
+    std::vector<Node> nodes;
+    std::vector<int> freeNodes;
+    int root = -1;
+
+    int maxDepth = 8;
+
+    // fixed traversal stack: at most 7 pending siblings per level
+    static const int maxDepthLimit = 16;
+    static const int stackSize = 7 * maxDepthLimit + 1;
+
+    // the root cell fits the bounds of list, objects that move out of it
+    // later are kept in the root
+    void Build(const std::vector<Spatial *> &list)
+    {
+        AABB box = {glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX)};
+        for (Spatial *s : list)
+            if (s)
+                box = {glm::min(box.min, s->bbox.min), glm::max(box.max, s->bbox.max)};
+
+        Clear();
+        if (box.min.x <= box.max.x)
+            CreateRoot(box);
+        for (Spatial *s : list)
+            Add(s);
+    }
+
+    void Clear()
+    {
+        objects.clear();
+        freeIds.clear();
+        nodes.clear();
+        freeNodes.clear();
+        root = -1;
+    }
+
+    // returns the new object id, a null object only reserves the id
+    int Add(Spatial *s)
+    {
+        int id;
+        if (!freeIds.empty())
+        {
+            id = freeIds.back();
+            freeIds.pop_back();
+        }
+        else
+        {
+            id = (int)objects.size();
+            objects.push_back({});
+        }
+        objects[id] = {s, -1, -1, -1};
+        if (s)
+            Link(id, FindNode(s->bbox));
+        return id;
+    }
+
+    void Remove(int id)
+    {
+        if (!objects[id].spatial)
+            return;
+        if (objects[id].node >= 0)
+            Unlink(id);
+        objects[id].spatial = nullptr;
+        freeIds.push_back(id);
+    }
+
+    // call after object id moved, or after a reserved id got its object; it
+    // stays in its node while its bounds are inside the node's loose box,
+    // objects in the root are placed again
+    void Update(int id)
+    {
+        Object &o = objects[id];
+        if (!o.spatial)
+            return;
+        const AABB &box = o.spatial->bbox;
+        if (o.node >= 0)
+        {
+            if (o.node != root && Contains(LooseBox(o.node), box))
+                return;
+            Unlink(id);
+        }
+        Link(id, FindNode(box));
+    }
+
+    AABB LooseBox(int n) const
+    {
+        glm::vec3 h(nodes[n].halfSize * 2.0f);
+        return {nodes[n].center - h, nodes[n].center + h};
+    }
+
+    static bool Contains(const AABB &outer, const AABB &inner)
+    {
+        return glm::all(glm::lessThanEqual(outer.min, inner.min)) &&
+               glm::all(glm::greaterThanEqual(outer.max, inner.max));
+    }
+
+    void CreateRoot(const AABB &box)
+    {
+        glm::vec3 e = (box.max - box.min) * 0.5f;
+        root = AllocateNode((box.min + box.max) * 0.5f, std::max(std::max(e.x, e.y), std::max(e.z, 1e-6f)), -1);
+    }
+
+    int AllocateNode(const glm::vec3 &center, float halfSize, int parent)
+    {
+        int n;
+        if (!freeNodes.empty())
+        {
+            n = freeNodes.back();
+            freeNodes.pop_back();
+        }
+        else
+        {
+            n = (int)nodes.size();
+            nodes.push_back({});
+        }
+        nodes[n] = {center, halfSize, parent, {-1, -1, -1, -1, -1, -1, -1, -1}, -1, 0};
+        return n;
+    }
+
+    // the node an object with bounds box belongs in, creating the missing levels:
+    // children of half the size as long as the box fits their loose boxes. The
+    // first object of an empty tree sizes the root
+    int FindNode(const AABB &box)
+    {
+        if (root < 0)
+            CreateRoot(box);
+
+        glm::vec3 c = (box.min + box.max) * 0.5f;
+        glm::vec3 e = (box.max - box.min) * 0.5f;
+        float radius = std::max(e.x, std::max(e.y, e.z));
+
+        // a center outside the root cell leaves the object in the root
+        int n = root;
+        const Node &r = nodes[root];
+        if (glm::any(glm::greaterThan(glm::abs(c - r.center), glm::vec3(r.halfSize))))
+            return n;
+
+        int depthLimit = std::min(maxDepth, (int)maxDepthLimit);
+        for (int depth = 0; depth < depthLimit; depth++)
+        {
+            float h = nodes[n].halfSize * 0.5f;
+            if (radius > h)
+                break;
+
+            glm::vec3 center = nodes[n].center;
+            int i = (c.x >= center.x) | (c.y >= center.y) << 1 | (c.z >= center.z) << 2;
+            if (nodes[n].child[i] < 0)
+            {
+                glm::vec3 offset((i & 1) ? h : -h, (i & 2) ? h : -h, (i & 4) ? h : -h);
+                int child = AllocateNode(center + offset, h, n);
+                nodes[n].child[i] = child;
+            }
+            n = nodes[n].child[i];
+        }
+        return n;
+    }
+
+    void Link(int id, int n)
+    {
+        Object &o = objects[id];
+        o.node = n;
+        o.prev = -1;
+        o.next = nodes[n].firstObject;
+        if (o.next >= 0)
+            objects[o.next].prev = id;
+        nodes[n].firstObject = id;
+        for (; n >= 0; n = nodes[n].parent)
+            nodes[n].numObjects++;
+    }
+
+    // takes id out of its node and drops the nodes left empty, except the root
+    void Unlink(int id)
+    {
+        Object &o = objects[id];
+        int n = o.node;
+        if (o.prev >= 0)
+            objects[o.prev].next = o.next;
+        else
+            nodes[n].firstObject = o.next;
+        if (o.next >= 0)
+            objects[o.next].prev = o.prev;
+        o.node = o.prev = o.next = -1;
+
+        while (n >= 0)
+        {
+            int parent = nodes[n].parent;
+            if (--nodes[n].numObjects == 0 && parent >= 0)
+            {
+                for (int &c : nodes[parent].child)
+                    if (c == n)
+                        c = -1;
+                freeNodes.push_back(n);
+            }
+            n = parent;
+        }
+    }
+
+    // closest hit over all objects, outId is the object id
+    bool Raycast(const Ray &ray, HitInfo &outHit, int &outId) const
+    {
+        if (root < 0)
+            return false;
+
+        glm::vec3 invDir = 1.0f / ray.dir;
+        HitInfo best = {FLT_MAX, -1};
+        int bestId = -1;
+
+        // the root is always visited, it may hold objects outside its box
+        struct Entry { int node; float t; };
+        Entry stack[stackSize];
+        int sp = 0;
+        stack[sp++] = {root, 0.0f};
+
+        while (sp > 0)
+        {
+            Entry e = stack[--sp];
+            if (e.t >= best.t)
+                continue;
+            const Node &node = nodes[e.node];
+            for (int id = node.firstObject; id >= 0; id = objects[id].next)
+            {
+                const Spatial *s = objects[id].spatial;
+                float tBox;
+                HitInfo hit;
+                if (RaySlab(ray.origin, invDir, s->bbox.min, s->bbox.max, best.t, tBox) && s->Raycast(ray, hit) && hit.t < best.t)
+                {
+                    best = hit;
+                    bestId = id;
+                }
+            }
+
+            // children sorted far to near, so the nearest is visited next
+            Entry hitChildren[8];
+            int count = 0;
+            for (int c : node.child)
+            {
+                if (c < 0)
+                    continue;
+                AABB box = LooseBox(c);
+                float t;
+                if (!RaySlab(ray.origin, invDir, box.min, box.max, best.t, t))
+                    continue;
+                int k = count++;
+                for (; k > 0 && hitChildren[k - 1].t < t; k--)
+                    hitChildren[k] = hitChildren[k - 1];
+                hitChildren[k] = {c, t};
+            }
+            for (int k = 0; k < count; k++)
+                stack[sp++] = hitChildren[k];
+        }
+
+        if (bestId < 0)
+            return false;
+        outHit = best;
+        outId = bestId;
+        return true;
+    }
+
+    // true if any object is hit with 0 < t < tMax
+    bool Occluded(const Ray &ray, float tMax) const
+    {
+        if (root < 0)
+            return false;
+
+        glm::vec3 invDir = 1.0f / ray.dir;
+        int stack[stackSize];
+        int sp = 0;
+        stack[sp++] = root;
+
+        while (sp > 0)
+        {
+            const Node &node = nodes[stack[--sp]];
+            for (int id = node.firstObject; id >= 0; id = objects[id].next)
+            {
+                const Spatial *s = objects[id].spatial;
+                float tBox;
+                if (RaySlab(ray.origin, invDir, s->bbox.min, s->bbox.max, tMax, tBox) && s->Occluded(ray, tMax))
+                    return true;
+            }
+
+            for (int c : node.child)
+            {
+                if (c < 0)
+                    continue;
+                AABB box = LooseBox(c);
+                float t;
+                if (RaySlab(ray.origin, invDir, box.min, box.max, tMax, t))
+                    stack[sp++] = c;
+            }
+        }
+        return false;
+    }
+
+    // calls fn(id) for the objects whose world bounds overlap box, fn returns
+    // false to stop; returns false if it did
+    template <class Fn>
+    bool ForEachOverlap(const AABB &box, Fn &&fn) const
+    {
+        if (root < 0)
+            return true;
+
+        int stack[stackSize];
+        int sp = 0;
+        stack[sp++] = root;
+
+        while (sp > 0)
+        {
+            const Node &node = nodes[stack[--sp]];
+            for (int id = node.firstObject; id >= 0; id = objects[id].next)
+                if (AABBIntersects(box, objects[id].spatial->bbox) && !fn(id))
+                    return false;
+
+            for (int c : node.child)
+                if (c >= 0 && AABBIntersects(box, LooseBox(c)))
+                    stack[sp++] = c;
+        }
+        return true;
+    }
+
+    // calls fn(id) for every object with a triangle in the frustum, fn returns
+    // false to stop; objects wholly inside are taken without touching their triangles
+    template <class Fn>
+    bool ForEachInFrustum(const Frustum &f, Fn &&fn) const
+    {
+        if (root < 0)
+            return true;
+
+        int stack[stackSize];
+        int sp = 0;
+        stack[sp++] = root;
+
+        while (sp > 0)
+        {
+            const Node &node = nodes[stack[--sp]];
+            for (int id = node.firstObject; id >= 0; id = objects[id].next)
+            {
+                const Spatial *s = objects[id].spatial;
+                FrustumSide side = FrustumAABB(f, s->bbox);
+                if (side == FrustumSide::Outside)
+                    continue;
+                if ((side == FrustumSide::Inside || s->InFrustum(f)) && !fn(id))
+                    return false;
+            }
+
+            for (int c : node.child)
+                if (c >= 0 && FrustumAABB(f, LooseBox(c)) != FrustumSide::Outside)
+                    stack[sp++] = c;
+        }
+        return true;
+    }
+
+    // ids of the objects whose world bounds overlap box
+    void QueryAABB(const AABB &box, std::vector<int> &out) const
+    {
+        ForEachOverlap(box, [&](int id) {
+            out.push_back(id);
+            return true;
+        });
+    }
+
+    // true if a triangle of any object touches box
+    bool Overlaps(const AABB &box) const
+    {
+        return !ForEachOverlap(box, [&](int id) { return !objects[id].spatial->Overlaps(box); });
+    }
+};
+
+#endif
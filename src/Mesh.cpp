@@ -11,8 +11,11 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb/stb_image.h>
 
-#include "Grid.h"
-#include "Octree.h"
+#include "Instance.h"
+#include "ThreadPool.h"
+
+#include <map>
+#include <algorithm>
 
 Mesh::Mesh()
 {
@@ -25,6 +28,7 @@ Mesh::~Mesh()
 void Mesh::init(std::string path, GLuint id)
 {
     shaderId = id;
+    modelPath = path;
     loadModel(path);
     initBuffer();
 }
@@ -33,6 +37,7 @@ void Mesh::initFromData(const std::vector<Vertex>& verts,
                         GLuint id)
 {
     shaderId = id;
+    modelPath.clear();
     vertices = verts;
     indices = idx;
     subMeshes.clear();
@@ -41,14 +46,98 @@ void Mesh::initFromData(const std::vector<Vertex>& verts,
 
     initBuffer();
 }
-void Mesh::initSpatial(bool useOctree, glm::mat4 mat)
+// object-space structures shared by every mesh loaded from the same file
+static std::map<std::pair<std::string, SpatialType>, std::shared_ptr<Spatial>> blasCache;
+
+// builds queued by initSpatial, run by buildPendingSpatials
+struct PendingBuild
 {
-    if (useOctree)
-        pSpatial = std::make_unique<Octree>();
+    Spatial *spatial;
+    Mesh *mesh;         // source of the geometry
+    glm::mat4 mat;
+};
+
+// instances wait for their BLAS to be built
+struct PendingInstance
+{
+    Mesh *mesh;
+    std::shared_ptr<Spatial> blas;
+    glm::mat4 mat;
+};
+
+// built structures are kept here between runs, keyed by geometry, backend and matrix
+static const char *spatialCacheDir = "spatial_cache";
+
+static std::vector<PendingBuild> pendingBuilds;
+static std::vector<PendingInstance> pendingInstances;
+static bool bSpatialBatch = false;
+
+void Mesh::initSpatial(SpatialType type, glm::mat4 mat, bool bInstanced)
+{
+    if (!bInstanced)
+    {
+        pSpatial = CreateSpatial(type);
+        pendingBuilds.push_back({pSpatial.get(), this, mat});
+    }
     else
-        pSpatial = std::make_unique<Grid>(glm::ivec3(32));
-    
-    pSpatial->Build(vertices, indices, mat);
+    {
+        // procedural meshes have no file to share by, they keep their own BLAS
+        std::shared_ptr<Spatial> blas;
+        if (!modelPath.empty())
+            blas = blasCache[{modelPath, type}];
+
+        if (!blas)
+        {
+            blas = CreateSpatial(type);
+            pendingBuilds.push_back({blas.get(), this, glm::mat4(1.0f)});
+            if (!modelPath.empty())
+                blasCache[{modelPath, type}] = blas;
+        }
+        pendingInstances.push_back({this, blas, mat});
+    }
+
+    if (!bSpatialBatch)
+        buildPendingSpatials();
+}
+
+void Mesh::beginSpatialBatch()
+{
+    bSpatialBatch = true;
+}
+
+void Mesh::endSpatialBatch()
+{
+    bSpatialBatch = false;
+    buildPendingSpatials();
+}
+
+void Mesh::buildPendingSpatials()
+{
+    // meshes are independent, each build runs on its own pool thread;
+    // biggest first so a large mesh does not start last and hold up the rest
+    std::sort(pendingBuilds.begin(), pendingBuilds.end(), [](const PendingBuild &a, const PendingBuild &b) {
+        return a.mesh->indices.size() > b.mesh->indices.size();
+    });
+    ThreadPool::Global().ParallelFor((int)pendingBuilds.size(), 1, [](int begin, int end) {
+        for (int i = begin; i < end; i++)
+        {
+            PendingBuild &job = pendingBuilds[i];
+            job.spatial->BuildCached(spatialCacheDir, job.mesh->vertices, job.mesh->indices, job.mat);
+        }
+    });
+
+    // the model log of loadModel comes before the build, the structure's follows here
+    for (PendingBuild &job : pendingBuilds)
+    {
+        std::cout << "spatial " << (job.mesh->modelPath.empty() ? "(procedural)" : job.mesh->modelPath) << " ";
+        job.spatial->Stats().Print(std::cout);
+    }
+
+    for (PendingInstance &inst : pendingInstances)
+        inst.mesh->pSpatial = std::make_unique<Instance>(inst.blas, inst.mat);
+
+    pendingBuilds.clear();
+    pendingInstances.clear();
 }
 void Mesh::loadModel(std::string path)
 {
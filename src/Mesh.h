@@ -50,6 +50,9 @@ protected:
     // my shader program ID
     GLuint shaderId;
 
+    // file the geometry came from, empty for procedural meshes
+    std::string modelPath;
+
     // picking highlight boolean
     bool bPicked = false;
     
@@ -75,6 +78,9 @@ protected:
     // NOT USED
     //Material loadMaterial(aiMaterial* mat);
 
+    // runs the builds queued by initSpatial
+    static void buildPendingSpatials();
+
 public:
 
     std::unique_ptr<Spatial> pSpatial = nullptr;
@@ -89,7 +95,14 @@ public:
                       GLuint shaderId);
     void loadModel(std::string path);
 
-    void initSpatial(bool useOctree, glm::mat4 mat);
+    // bInstanced shares one object-space structure between all meshes loaded
+    // from the same file and only places it with mat
+    void initSpatial(SpatialType type, glm::mat4 mat, bool bInstanced = false);
+
+    // initSpatial calls between these two only queue their builds (pSpatial is
+    // not usable yet), endSpatialBatch runs them all at once on the worker pool
+    static void beginSpatialBatch();
+    static void endSpatialBatch();
 
     void setShaderId(GLuint sid);
 
@@ -1,158 +1,635 @@
 #ifndef __OCTREE_H__
 #define __OCTREE_H__
 
+#include <cstdint>
 #include "Spatial.h"
+#include "RayPacket.h"
+#include "ThreadPool.h"
+#include "SpatialCache.h"
 
 // ------------------ Octree ------------------
 class Octree : public Spatial
 {
 public:
+    // nodes live in one flat array, the 8 children of a node are stored contiguously
     struct Node
     {
         AABB box;
-        std::vector<int> tris;
-        std::shared_ptr<Node> child[8] = {nullptr};
+        uint32_t firstChild = 0; // index of child[0], 0 for leaves (the root is never a child)
+        uint32_t triOffset = 0;  // first entry in triRefs
+        uint32_t triCount = 0;
     };
 
-    std::shared_ptr<Node> root = nullptr;
+    std::vector<Node> nodes;
+    std::vector<int> triRefs;   // triangle references of all leaves, back to back
     int maxDepth = 8;
     int maxPerNode = 16;
 
-    std::shared_ptr<Node> CreateNode(const AABB &box)
+    // fixed traversal stack: at most 7 pending siblings per level
+    static const int maxDepthLimit = 16;
+    static const int stackSize = 7 * maxDepthLimit + 1;
+
+    // per-triangle data only needed while building, in buildArena
+    std::span<AABB> triBounds;
+    std::vector<int> buildTris;
+
+    // nodes and triangle references of one part of the tree, so parts can be built
+    // concurrently and joined afterwards; node 0 is the part's root
+    struct Subtree
     {
-        std::shared_ptr<Node> n = std::make_shared<Node>();
-        n->box = box;
-        return n;
-    }
+        std::pmr::vector<Node> nodes;
+        std::pmr::vector<int> triRefs;
+
+        explicit Subtree(std::pmr::memory_resource *arena) : nodes(arena), triRefs(arena) {}
+    };
+
+    // a node still to be built: where it is and which triangles reach it
+    struct PendingNode
+    {
+        uint32_t node;
+        std::span<const int> tris;
+        int depth;
+    };
 
     void Build(const std::vector<Vertex>& vList, const std::vector<unsigned int>& tIdxList, glm::mat4 mat)
     {
         Spatial::Build(vList, tIdxList, mat);
 
-        root = CreateNode(bbox);
+        int numTris = (int)triIdxList.size() / 3;
+        ThreadPool &pool = ThreadPool::Global();
+        maxDepth = std::min(maxDepth, (int)maxDepthLimit);
 
-        InsertTriangles();
-    }
+        triBounds = buildArena.Alloc<AABB>(numTris);
+        buildTris.resize(numTris);
+        pool.ParallelFor(numTris, 4096, [&](int begin, int end) {
+            for (int i = begin; i < end; i++)
+            {
+                Triangle t = getTriangle(i);
+                triBounds[i] = {glm::min(t.v0, glm::min(t.v1, t.v2)), glm::max(t.v0, glm::max(t.v1, t.v2))};
+                buildTris[i] = i;
+            }
+        });
+
+        // split the top levels here until there are enough independent subtrees
+        // to keep every thread busy, the ones too small to be worth it stay serial
+        Subtree top(&buildArena);
+        top.nodes.push_back({bbox});
+        std::pmr::vector<PendingNode> pending(&buildArena), next(&buildArena);
+        pending.push_back({0, buildTris, 0});
+        const int minSubtreeTris = 256;
+        int wanted = pool.Size() > 1 ? pool.Size() * 4 : 1;
+        while ((int)pending.size() < wanted)
+        {
+            next.clear();
+            bool bSplit = false;
+            for (const PendingNode &p : pending)
+            {
+                std::span<int> childTris[8];
+                if ((int)p.tris.size() < minSubtreeTris || !SplitTris(top.nodes[p.node].box, p.tris, p.depth, buildArena, childTris))
+                {
+                    next.push_back(p);
+                    continue;
+                }
+                uint32_t first = AddChildren(top, p.node);
+                for (int i = 0; i < 8; i++)
+                    next.push_back({first + i, childTris[i], p.depth + 1});
+                bSplit = true;
+            }
+            std::swap(pending, next);
+            if (!bSplit)
+                break;
+        }
+
+        // part i has two task arenas: 2i for its nodes and references, 2i + 1 for
+        // the triangle lists, which BuildNode keeps rewinding
+        int numParts = (int)pending.size();
+        ResetTaskArenas(2 * numParts);
+        std::pmr::vector<Subtree> parts(&buildArena);
+        parts.reserve(numParts);
+        for (int i = 0; i < numParts; i++)
+            parts.emplace_back(&taskArenas[2 * i]);
+        pool.ParallelFor(numParts, 1, [&](int begin, int end) {
+            for (int i = begin; i < end; i++)
+            {
+                parts[i].nodes.push_back({top.nodes[pending[i].node].box});
+                BuildNode(parts[i], taskArenas[2 * i + 1], 0, pending[i].tris, pending[i].depth);
+            }
+        });
 
-    void Insert(int triIdx) override {
-        InsertTri(root, triIdx, 0);
+        // join: part roots replace their top-level node, the rest is appended;
+        // nodes and triRefs keep their capacity from the last build
+        nodes.assign(top.nodes.begin(), top.nodes.end());
+        triRefs.clear();
+        if (numParts == 1)
+        {
+            // not split above, the only part is the whole tree
+            nodes.assign(parts[0].nodes.begin(), parts[0].nodes.end());
+            triRefs.assign(parts[0].triRefs.begin(), parts[0].triRefs.end());
+            parts.clear();
+        }
+        for (size_t i = 0; i < parts.size(); i++)
+        {
+            uint32_t nodeBase = (uint32_t)nodes.size() - 1;
+            uint32_t refBase = (uint32_t)triRefs.size();
+            for (size_t k = 0; k < parts[i].nodes.size(); k++)
+            {
+                Node n = parts[i].nodes[k];
+                if (n.firstChild != 0)
+                    n.firstChild += nodeBase;
+                n.triOffset += refBase;
+                if (k == 0)
+                    nodes[pending[i].node] = n;
+                else
+                    nodes.push_back(n);
+            }
+            triRefs.insert(triRefs.end(), parts[i].triRefs.begin(), parts[i].triRefs.end());
+        }
+
+        triBounds = {};
     }
 
-    void Subdivide(std::shared_ptr<Node> n)
+    // octant i of box, bit 0/1/2 selects the upper half in x/y/z
+    static AABB ChildBox(const AABB &box, int i)
     {
         // center
-        glm::vec3 c = (n->box.min + n->box.max) * 0.5f;
-        glm::vec3 minB = n->box.min;
-        glm::vec3 maxB = n->box.max;
+        glm::vec3 c = (box.min + box.max) * 0.5f;
+        return {
+            {(i & 1) ? c.x : box.min.x, (i & 2) ? c.y : box.min.y, (i & 4) ? c.z : box.min.z},
+            {(i & 1) ? box.max.x : c.x, (i & 2) ? box.max.y : c.y, (i & 4) ? box.max.z : c.z}};
+    }
+
+    static void MakeLeaf(Subtree &out, uint32_t n, std::span<const int> tris)
+    {
+        out.nodes[n].triOffset = (uint32_t)out.triRefs.size();
+        out.nodes[n].triCount = (uint32_t)tris.size();
+        out.triRefs.insert(out.triRefs.end(), tris.begin(), tris.end());
+    }
 
+    // appends the 8 children of node n, returns the first
+    static uint32_t AddChildren(Subtree &out, uint32_t n)
+    {
+        AABB box = out.nodes[n].box;
+        uint32_t first = (uint32_t)out.nodes.size();
+        out.nodes[n].firstChild = first;
         for (int i = 0; i < 8; i++)
         {
-            glm::vec3 pMin = {
-                (i & 1) ? c.x : minB.x,
-                (i & 2) ? c.y : minB.y,
-                (i & 4) ? c.z : minB.z};
+            Node child;
+            child.box = ChildBox(box, i);
+            out.nodes.push_back(child);
+        }
+        return first;
+    }
 
-            glm::vec3 pMax = {
-                (i & 1) ? maxB.x : c.x,
-                (i & 2) ? maxB.y : c.y,
-                (i & 4) ? maxB.z : c.z};
-            n->child[i] = CreateNode({pMin, pMax});
+    bool IsLeafSize(std::span<const int> tris, int depth) const
+    {
+        return depth == maxDepth || (int)tris.size() <= maxPerNode;
+    }
+
+    // distributes tris over the octants of box into lists allocated from arena,
+    // false if the node should stay a leaf
+    bool SplitTris(const AABB &box, std::span<const int> tris, int depth, BuildArena &arena, std::span<int> (&childTris)[8]) const
+    {
+        if (IsLeafSize(tris, depth))
+            return false;
+
+        // the octants each triangle touches, counted first so every list gets its exact size
+        std::span<uint8_t> masks = arena.Alloc<uint8_t>(tris.size());
+        size_t counts[8] = {};
+        AABB childBoxes[8];
+        for (int i = 0; i < 8; i++)
+            childBoxes[i] = ChildBox(box, i);
+        for (size_t k = 0; k < tris.size(); k++)
+        {
+            const AABB &tb = triBounds[tris[k]];
+            uint8_t mask = 0;
+            for (int i = 0; i < 8; i++)
+                if (AABBIntersects(tb, childBoxes[i]))
+                {
+                    mask |= 1 << i;
+                    counts[i]++;
+                }
+            masks[k] = mask;
+        }
+
+        // every child would get every triangle, splitting only duplicates them
+        bool bSplits = false;
+        for (int i = 0; i < 8; i++)
+            bSplits |= counts[i] < tris.size();
+        if (!bSplits)
+            return false;
+
+        for (int i = 0; i < 8; i++)
+        {
+            childTris[i] = arena.Alloc<int>(counts[i]);
+            counts[i] = 0;
         }
+        for (size_t k = 0; k < tris.size(); k++)
+            for (int i = 0; i < 8; i++)
+                if (masks[k] >> i & 1)
+                    childTris[i][counts[i]++] = tris[k];
+        return true;
     }
 
-    void InsertTri(std::shared_ptr<Node> n, int triIndex, int depth)
+    // the child lists of a node are dropped from arena once its subtree is built,
+    // so the arena only ever holds the lists along one path down the tree; out
+    // must not grow in the same arena
+    void BuildNode(Subtree &out, BuildArena &arena, uint32_t n, std::span<const int> tris, int depth) const
     {
-        if (depth == maxDepth)
+        BuildArena::Mark mark = arena.GetMark();
+        std::span<int> childTris[8];
+        if (!SplitTris(out.nodes[n].box, tris, depth, arena, childTris))
         {
-            n->tris.push_back(triIndex);
+            arena.Rewind(mark);
+            MakeLeaf(out, n, tris);
             return;
         }
 
-        Triangle t = getTriangle(triIndex);
-        glm::vec3 triMin = glm::min(t.v0, glm::min(t.v1, t.v2));
-        glm::vec3 triMax = glm::max(t.v0, glm::max(t.v1, t.v2));
+        uint32_t first = AddChildren(out, n);
+        for (int i = 0; i < 8; i++)
+            BuildNode(out, arena, first + i, childTris[i], depth + 1);
+        arena.Rewind(mark);
+    }
 
-        if (n->tris.size() < maxPerNode) {
-            n->tris.push_back(triIndex);
-            return;
+    bool Raycast(const Ray &ray, HitInfo &outHit) const override
+    {
+        if (nodes.empty())
+            return false;
+
+        glm::vec3 invDir = 1.0f / ray.dir;
+        WatertightRay wray(ray);
+        HitInfo best = {FLT_MAX, -1};
+
+        struct Entry { uint32_t node; float t; };
+        Entry stack[stackSize];
+        int sp = 0;
+
+        float tRoot;
+        if (RaySlab(ray.origin, invDir, nodes[0].box.min, nodes[0].box.max, best.t, tRoot))
+            stack[sp++] = {0, tRoot};
+
+        while (sp > 0)
+        {
+            Entry e = stack[--sp];
+            // a closer hit was found after this node was pushed
+            if (e.t > best.t)
+                continue;
+
+            const Node &n = nodes[e.node];
+            if (n.firstChild == 0)
+            {
+                for (uint32_t i = n.triOffset; i < n.triOffset + n.triCount; i++)
+                {
+                    float t;
+                    if (RayTriangle(wray, getPackedTriangle(triRefs[i]), best.t, t))
+                        best = {t, triRefs[i]};
+                }
+                continue;
+            }
+
+            // sort the children the ray enters by entry distance
+            Entry hits[8];
+            int numHits = 0;
+            for (uint32_t i = 0; i < 8; i++)
+            {
+                const Node &c = nodes[n.firstChild + i];
+                float t;
+                if ((c.firstChild != 0 || c.triCount > 0) &&
+                    RaySlab(ray.origin, invDir, c.box.min, c.box.max, best.t, t))
+                {
+                    int k = numHits++;
+                    for (; k > 0 && hits[k - 1].t < t; k--)
+                        hits[k] = hits[k - 1];
+                    hits[k] = {n.firstChild + i, t};
+                }
+            }
+
+            // farthest first, so the nearest child is popped next
+            for (int i = 0; i < numHits; i++)
+                stack[sp++] = hits[i];
         }
 
-        if (n->child[0] == nullptr)
-            Subdivide(n);
+        if (best.triIndex < 0)
+            return false;
+        outHit = best;
+        return true;
+    }
 
-        for (int i = 0; i < 8; i++)
+    bool Occluded(const Ray &ray, float tMax) const override
+    {
+        if (nodes.empty())
+            return false;
+
+        glm::vec3 invDir = 1.0f / ray.dir;
+        WatertightRay wray(ray);
+
+        // no child sorting, any hit ends the search
+        uint32_t stack[stackSize];
+        int sp = 0;
+        stack[sp++] = 0;
+
+        while (sp > 0)
         {
-            const AABB &b = n->child[i]->box;
-            if (!(triMax.x < b.min.x || triMin.x > b.max.x ||
-                  triMax.y < b.min.y || triMin.y > b.max.y ||
-                  triMax.z < b.min.z || triMin.z > b.max.z))
+            const Node &n = nodes[stack[--sp]];
+            float tNode;
+            if (!RaySlab(ray.origin, invDir, n.box.min, n.box.max, tMax, tNode))
+                continue;
+
+            if (n.firstChild == 0)
             {
-                InsertTri(n->child[i], triIndex, depth + 1);
+                for (uint32_t i = n.triOffset; i < n.triOffset + n.triCount; i++)
+                {
+                    float t;
+                    if (RayTriangle(wray, getPackedTriangle(triRefs[i]), tMax, t))
+                        return true;
+                }
+                continue;
+            }
+
+            for (uint32_t i = 0; i < 8; i++)
+            {
+                const Node &c = nodes[n.firstChild + i];
+                if (c.firstChild != 0 || c.triCount > 0)
+                    stack[sp++] = n.firstChild + i;
             }
         }
+        return false;
     }
 
+    void RaycastPacket(const Ray *rays, int count, HitInfo *outHits) const override
+    {
+        TracePackets(*this, rays, count, outHits, [this](RayPacket &p) { TracePacket(p); });
+    }
 
-    bool RaycastNode(std::shared_ptr<Node> n, const Ray &ray, HitInfo &best)
+    // one traversal for the whole packet, a node is entered while any lane still needs it
+    void TracePacket(RayPacket &p) const
     {
-        float t;
+        if (nodes.empty())
+            return;
 
-        if (!RayAABB(ray.origin, ray.dir, n->box.min, n->box.max, t))
-            return false;
+        // with a shared direction octant, children in order (i ^ octant) are front to back
+        int octant = p.Octant();
+        uint32_t stack[stackSize];
+        int sp = 0;
+        stack[sp++] = 0;
 
-        bool hit = false;
+        while (sp > 0)
+        {
+            const Node &n = nodes[stack[--sp]];
+            if (!PacketSlab(p, n.box))
+                continue;
 
-        for (int triIdx : n->tris)  {
-            float tt;
-            Triangle tri = getTriangle(triIdx);
-            if (RayTriangle(ray, tri, tt) && tt < best.t)
+            if (n.firstChild == 0)
             {
-                best.t = tt;
-                best.triIndex = triIdx;
-                hit = true;
+                for (uint32_t i = n.triOffset; i < n.triOffset + n.triCount; i++)
+                    PacketTriangle(p, getPackedTriangle(triRefs[i]), triRefs[i]);
+                continue;
+            }
+
+            for (int k = 7; k >= 0; k--)
+            {
+                uint32_t c = n.firstChild + (k ^ octant);
+                if (nodes[c].firstChild != 0 || nodes[c].triCount > 0)
+                    stack[sp++] = c;
             }
         }
+    }
 
-        for (int i = 0; i < 8; i++)
-            if (n->child[i])
-                hit |= RaycastNode(n->child[i], ray, best);
+    void QueryAABB(const AABB &box, std::vector<int> &out) const override
+    {
+        if (nodes.empty() || !AABBIntersects(box, nodes[0].box))
+            return;
 
-        return hit;
+        // each triangle once, even when it is stored in several leaves
+        OverlapMarks marks((int)triList.size());
+        uint32_t stack[stackSize];
+        int sp = 0;
+        stack[sp++] = 0;
+
+        while (sp > 0)
+        {
+            const Node &n = nodes[stack[--sp]];
+            if (n.firstChild == 0)
+            {
+                for (uint32_t i = n.triOffset; i < n.triOffset + n.triCount; i++)
+                    if (marks.Mark(triRefs[i]))
+                        out.push_back(triRefs[i]);
+                continue;
+            }
+
+            for (uint32_t i = 0; i < 8; i++)
+                if (AABBIntersects(box, nodes[n.firstChild + i].box))
+                    stack[sp++] = n.firstChild + i;
+        }
     }
 
-    bool Raycast(const Ray &ray, HitInfo &outHit) override
+    bool VisitOverlaps(const AABB &box, OverlapFn fn, void *ctx) const override
     {
-        HitInfo best;
-        best.t = FLT_MAX;
-        best.triIndex = -1;
+        if (nodes.empty() || !AABBIntersects(box, nodes[0].box))
+            return true;
+
+        // a triangle crossing child boxes is stored in several leaves
+        OverlapMarks marks((int)triList.size());
+        uint32_t stack[stackSize];
+        int sp = 0;
+        stack[sp++] = 0;
+
+        while (sp > 0)
+        {
+            const Node &n = nodes[stack[--sp]];
+            if (n.firstChild == 0)
+            {
+                for (uint32_t i = n.triOffset; i < n.triOffset + n.triCount; i++)
+                {
+                    int triIdx = triRefs[i];
+                    if (marks.Mark(triIdx) && TriangleAABB(getTriangle(triIdx), box) && !fn(ctx, triIdx))
+                        return false;
+                }
+                continue;
+            }
 
-        bool result = RaycastNode(root, ray, best);
-        if (result)
-            outHit = best;
-        return result;
+            for (uint32_t i = 0; i < 8; i++)
+                if (AABBIntersects(box, nodes[n.firstChild + i].box))
+                    stack[sp++] = n.firstChild + i;
+        }
+        return true;
     }
 
-    void QueryNode(std::shared_ptr<Node> n, const AABB &box, std::vector<int> &out) const
+    bool QueryFrustum(const Frustum &f, OverlapFn fn, void *ctx) const override
     {
-        if (n == nullptr)
-            return;
+        if (nodes.empty())
+            return true;
+        FrustumSide rootSide = FrustumAABB(f, nodes[0].box);
+        if (rootSide == FrustumSide::Outside)
+            return true;
 
-        // AABB no intersection
-        if (n->box.max.x < box.min.x || n->box.min.x > box.max.x ||
-            n->box.max.y < box.min.y || n->box.min.y > box.max.y ||
-            n->box.max.z < box.min.z || n->box.min.z > box.max.z)
-            return;
+        // below a node inside the frustum no plane test is needed, the triangles
+        // still are: a leaf keeps every triangle whose bounds reach into it
+        OverlapMarks marks((int)triList.size());
+        uint32_t stack[stackSize];
+        bool stackInside[stackSize];
+        int sp = 0;
+        stack[sp] = 0;
+        stackInside[sp++] = rootSide == FrustumSide::Inside;
 
-        out.insert(out.end(), n->tris.begin(), n->tris.end());
+        while (sp > 0)
+        {
+            sp--;
+            const Node &n = nodes[stack[sp]];
+            bool bInside = stackInside[sp];
+            if (n.firstChild == 0)
+            {
+                for (uint32_t i = n.triOffset; i < n.triOffset + n.triCount; i++)
+                {
+                    int triIdx = triRefs[i];
+                    if (marks.Mark(triIdx) && FrustumTriangle(f, getTriangle(triIdx)) && !fn(ctx, triIdx))
+                        return false;
+                }
+                continue;
+            }
 
-        for (int i = 0; i < 8; i++)
-            QueryNode(n->child[i], box, out);
+            for (uint32_t i = 0; i < 8; i++)
+            {
+                uint32_t c = n.firstChild + i;
+                FrustumSide side = bInside ? FrustumSide::Inside : FrustumAABB(f, nodes[c].box);
+                if (side == FrustumSide::Outside)
+                    continue;
+                stack[sp] = c;
+                stackInside[sp++] = side == FrustumSide::Inside;
+            }
+        }
+        return true;
     }
 
-    void QueryAABB(const AABB &box, std::vector<int> &out) const override
+    // branch and bound: children are pushed far to near so the nearest is opened
+    // first, and nodes further away than the best point so far are dropped
+    bool ClosestPoint(const glm::vec3 &p, float maxDist, ClosestHit &outHit) const override
+    {
+        ClosestHit best = {glm::vec3(0.0f), maxDist * maxDist, -1};
+        if (nodes.empty() || PointAABBDist2(p, nodes[0].box) >= best.dist)
+            return false;
+
+        OverlapMarks marks((int)triList.size());
+        uint32_t stack[stackSize];
+        float stackDist[stackSize];
+        int sp = 0;
+        stack[sp] = 0;
+        stackDist[sp++] = 0.0f;
+
+        while (sp > 0)
+        {
+            sp--;
+            if (stackDist[sp] >= best.dist)
+                continue;
+            const Node &n = nodes[stack[sp]];
+            if (n.firstChild == 0)
+            {
+                for (uint32_t i = n.triOffset; i < n.triOffset + n.triCount; i++)
+                    if (marks.Mark(triRefs[i]))
+                        UpdateClosest(p, getTriangle(triRefs[i]), triRefs[i], best);
+                continue;
+            }
+
+            uint32_t order[8];
+            float dist[8];
+            int count = 0;
+            for (uint32_t c = n.firstChild; c < n.firstChild + 8; c++)
+            {
+                float d = PointAABBDist2(p, nodes[c].box);
+                if (d >= best.dist)
+                    continue;
+                int k = count++;
+                for (; k > 0 && dist[k - 1] < d; k--)
+                {
+                    order[k] = order[k - 1];
+                    dist[k] = dist[k - 1];
+                }
+                order[k] = c;
+                dist[k] = d;
+            }
+            for (int k = 0; k < count; k++)
+            {
+                stack[sp] = order[k];
+                stackDist[sp++] = dist[k];
+            }
+        }
+        return FinishClosest(best, outHit);
+    }
+
+    SpatialStats Stats() const override
+    {
+        SpatialStats s = Spatial::Stats();
+        s.type = "Octree";
+        s.bytes += VectorBytes(nodes) + VectorBytes(triRefs);
+        if (nodes.empty())
+            return s;
+
+        std::vector<std::pair<uint32_t, int>> todo = {{0, 0}};
+        while (!todo.empty())
+        {
+            auto [n, depth] = todo.back();
+            todo.pop_back();
+            const Node &node = nodes[n];
+            if (node.firstChild == 0)
+            {
+                s.AddLeaf(node.box, depth, (int)node.triCount);
+                continue;
+            }
+            s.AddNode(node.box, depth);
+            for (int i = 0; i < 8; i++)
+                todo.push_back({node.firstChild + i, depth + 1});
+        }
+        s.Finish(bbox);
+        return s;
+    }
+
+    std::string CacheParams() const override
+    {
+        return "Octree maxDepth " + std::to_string(maxDepth) + " maxPerNode " + std::to_string(maxPerNode);
+    }
+
+    bool SaveCache(BlobWriter &out) const override
     {
-        QueryNode(root, box, out);
+        out.WriteVector(nodes);
+        out.WriteVector(triRefs);
+        return true;
+    }
+
+    bool LoadCache(BlobReader &in) override
+    {
+        in.ReadVector(nodes);
+        in.ReadVector(triRefs);
+        return in.ok && !nodes.empty() &&
+               std::all_of(nodes.begin(), nodes.end(), [&](const Node &n) {
+                   return (n.firstChild == 0 || n.firstChild + 8 <= nodes.size()) &&
+                          (size_t)n.triOffset + n.triCount <= triRefs.size();
+               }) &&
+               ValidTree() &&
+               std::all_of(triRefs.begin(), triRefs.end(), [&](int t) { return t >= 0 && t < (int)triList.size(); });
+    }
+
+    // the nodes read from a file form one tree: child blocks after their parent,
+    // so there are no cycles, no node reached twice and no node deeper than
+    // maxDepthLimit, which sizes the traversal stacks
+    bool ValidTree() const
+    {
+        std::vector<std::pair<uint32_t, int>> todo = {{0, 0}};
+        size_t visited = 0;
+        while (!todo.empty())
+        {
+            auto [n, depth] = todo.back();
+            todo.pop_back();
+            if (depth > maxDepthLimit || ++visited > nodes.size())
+                return false;
+            uint32_t first = nodes[n].firstChild;
+            if (first == 0)
+                continue;
+            if (first <= n)
+                return false;
+            for (uint32_t i = 0; i < 8; i++)
+                todo.push_back({first + i, depth + 1});
+        }
+        return true;
     }
 };
 
-#endif
\ No newline at end of file
+#endif
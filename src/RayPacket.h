@@ -0,0 +1,278 @@
+#ifndef __RAYPACKET_H__
+#define __RAYPACKET_H__
+
+#include <cmath>
+#include "Spatial.h"
+
+// ------------------ SIMD lanes ------------------
+// SimdFloat holds one float per ray of a packet: 8 lanes with AVX2, 4 with
+// SSE2 (always there on x64) and a single lane otherwise. Comparisons give
+// lane masks that are only meant for &, |, Select and MoveMask.
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+struct SimdFloat
+{
+    static const int width = 8;
+    __m256 v;
+
+    SimdFloat() {}
+    SimdFloat(__m256 v) : v(v) {}
+    SimdFloat(float f) : v(_mm256_set1_ps(f)) {}
+};
+
+inline SimdFloat operator+(SimdFloat a, SimdFloat b) { return _mm256_add_ps(a.v, b.v); }
+inline SimdFloat operator-(SimdFloat a, SimdFloat b) { return _mm256_sub_ps(a.v, b.v); }
+inline SimdFloat operator*(SimdFloat a, SimdFloat b) { return _mm256_mul_ps(a.v, b.v); }
+inline SimdFloat operator/(SimdFloat a, SimdFloat b) { return _mm256_div_ps(a.v, b.v); }
+inline SimdFloat Min(SimdFloat a, SimdFloat b) { return _mm256_min_ps(a.v, b.v); }
+inline SimdFloat Max(SimdFloat a, SimdFloat b) { return _mm256_max_ps(a.v, b.v); }
+inline SimdFloat Abs(SimdFloat a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v); }
+inline SimdFloat operator<(SimdFloat a, SimdFloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+inline SimdFloat operator>(SimdFloat a, SimdFloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+inline SimdFloat operator<=(SimdFloat a, SimdFloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+inline SimdFloat operator>=(SimdFloat a, SimdFloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+inline SimdFloat operator&(SimdFloat a, SimdFloat b) { return _mm256_and_ps(a.v, b.v); }
+inline SimdFloat operator|(SimdFloat a, SimdFloat b) { return _mm256_or_ps(a.v, b.v); }
+inline SimdFloat Select(SimdFloat mask, SimdFloat a, SimdFloat b) { return _mm256_blendv_ps(b.v, a.v, mask.v); }
+inline int MoveMask(SimdFloat mask) { return _mm256_movemask_ps(mask.v); }
+inline SimdFloat LoadLanes(const float *p) { return _mm256_loadu_ps(p); }
+inline void StoreLanes(float *p, SimdFloat a) { _mm256_storeu_ps(p, a.v); }
+
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+
+struct SimdFloat
+{
+    static const int width = 4;
+    __m128 v;
+
+    SimdFloat() {}
+    SimdFloat(__m128 v) : v(v) {}
+    SimdFloat(float f) : v(_mm_set1_ps(f)) {}
+};
+
+inline SimdFloat operator+(SimdFloat a, SimdFloat b) { return _mm_add_ps(a.v, b.v); }
+inline SimdFloat operator-(SimdFloat a, SimdFloat b) { return _mm_sub_ps(a.v, b.v); }
+inline SimdFloat operator*(SimdFloat a, SimdFloat b) { return _mm_mul_ps(a.v, b.v); }
+inline SimdFloat operator/(SimdFloat a, SimdFloat b) { return _mm_div_ps(a.v, b.v); }
+inline SimdFloat Min(SimdFloat a, SimdFloat b) { return _mm_min_ps(a.v, b.v); }
+inline SimdFloat Max(SimdFloat a, SimdFloat b) { return _mm_max_ps(a.v, b.v); }
+inline SimdFloat Abs(SimdFloat a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v); }
+inline SimdFloat operator<(SimdFloat a, SimdFloat b) { return _mm_cmplt_ps(a.v, b.v); }
+inline SimdFloat operator>(SimdFloat a, SimdFloat b) { return _mm_cmpgt_ps(a.v, b.v); }
+inline SimdFloat operator<=(SimdFloat a, SimdFloat b) { return _mm_cmple_ps(a.v, b.v); }
+inline SimdFloat operator>=(SimdFloat a, SimdFloat b) { return _mm_cmpge_ps(a.v, b.v); }
+inline SimdFloat operator&(SimdFloat a, SimdFloat b) { return _mm_and_ps(a.v, b.v); }
+inline SimdFloat operator|(SimdFloat a, SimdFloat b) { return _mm_or_ps(a.v, b.v); }
+inline SimdFloat Select(SimdFloat mask, SimdFloat a, SimdFloat b) { return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v)); }
+inline int MoveMask(SimdFloat mask) { return _mm_movemask_ps(mask.v); }
+inline SimdFloat LoadLanes(const float *p) { return _mm_loadu_ps(p); }
+inline void StoreLanes(float *p, SimdFloat a) { _mm_storeu_ps(p, a.v); }
+
+#else
+
+// no SIMD: one lane, masks are 1.0 / 0.0
+struct SimdFloat
+{
+    static const int width = 1;
+    float v;
+
+    SimdFloat() {}
+    SimdFloat(float f) : v(f) {}
+};
+
+inline SimdFloat operator+(SimdFloat a, SimdFloat b) { return a.v + b.v; }
+inline SimdFloat operator-(SimdFloat a, SimdFloat b) { return a.v - b.v; }
+inline SimdFloat operator*(SimdFloat a, SimdFloat b) { return a.v * b.v; }
+inline SimdFloat operator/(SimdFloat a, SimdFloat b) { return a.v / b.v; }
+inline SimdFloat Min(SimdFloat a, SimdFloat b) { return std::min(a.v, b.v); }
+inline SimdFloat Max(SimdFloat a, SimdFloat b) { return std::max(a.v, b.v); }
+inline SimdFloat Abs(SimdFloat a) { return std::fabs(a.v); }
+inline SimdFloat operator<(SimdFloat a, SimdFloat b) { return a.v < b.v ? 1.0f : 0.0f; }
+inline SimdFloat operator>(SimdFloat a, SimdFloat b) { return a.v > b.v ? 1.0f : 0.0f; }
+inline SimdFloat operator<=(SimdFloat a, SimdFloat b) { return a.v <= b.v ? 1.0f : 0.0f; }
+inline SimdFloat operator>=(SimdFloat a, SimdFloat b) { return a.v >= b.v ? 1.0f : 0.0f; }
+inline SimdFloat operator&(SimdFloat a, SimdFloat b) { return a.v != 0.0f && b.v != 0.0f ? 1.0f : 0.0f; }
+inline SimdFloat operator|(SimdFloat a, SimdFloat b) { return a.v != 0.0f || b.v != 0.0f ? 1.0f : 0.0f; }
+inline SimdFloat Select(SimdFloat mask, SimdFloat a, SimdFloat b) { return mask.v != 0.0f ? a : b; }
+inline int MoveMask(SimdFloat mask) { return mask.v != 0.0f ? 1 : 0; }
+inline SimdFloat LoadLanes(const float *p) { return *p; }
+inline void StoreLanes(float *p, SimdFloat a) { *p = a.v; }
+
+#endif
+
+// ------------------ Ray packet ------------------
+struct RayPacket
+{
+    static const int width = SimdFloat::width;
+
+    SimdFloat ox, oy, oz;
+    SimdFloat dx, dy, dz;
+    SimdFloat ix, iy, iz;   // 1 / dir
+    SimdFloat sx, sy, sz;   // watertight shear, see WatertightRay
+    int kx, ky, kz;         // shared by all lanes when bSameAxis is set
+    bool bSameAxis;
+    SimdFloat tBest;
+    int triIndex[width];
+    int count;              // lanes holding real rays
+
+    // loads up to width rays, spare lanes repeat the last ray and are never stored
+    void Load(const Ray *rays, int n)
+    {
+        count = std::min(n, width);
+        float lanes[12][width];
+        bSameAxis = true;
+        for (int i = 0; i < width; i++)
+        {
+            const Ray &r = rays[std::min(i, count - 1)];
+            WatertightRay w(r);
+            if (i == 0)
+            {
+                kx = w.kx;
+                ky = w.ky;
+                kz = w.kz;
+            }
+            bSameAxis &= w.kz == kz;
+            lanes[9][i] = w.sx;
+            lanes[10][i] = w.sy;
+            lanes[11][i] = w.sz;
+            lanes[0][i] = r.origin.x;
+            lanes[1][i] = r.origin.y;
+            lanes[2][i] = r.origin.z;
+            lanes[3][i] = r.dir.x;
+            lanes[4][i] = r.dir.y;
+            lanes[5][i] = r.dir.z;
+            lanes[6][i] = 1.0f / r.dir.x;
+            lanes[7][i] = 1.0f / r.dir.y;
+            lanes[8][i] = 1.0f / r.dir.z;
+            triIndex[i] = -1;
+        }
+        ox = LoadLanes(lanes[0]); oy = LoadLanes(lanes[1]); oz = LoadLanes(lanes[2]);
+        dx = LoadLanes(lanes[3]); dy = LoadLanes(lanes[4]); dz = LoadLanes(lanes[5]);
+        ix = LoadLanes(lanes[6]); iy = LoadLanes(lanes[7]); iz = LoadLanes(lanes[8]);
+        sx = LoadLanes(lanes[9]); sy = LoadLanes(lanes[10]); sz = LoadLanes(lanes[11]);
+        tBest = SimdFloat(FLT_MAX);
+    }
+
+    void Store(HitInfo *out) const
+    {
+        float t[width];
+        StoreLanes(t, tBest);
+        for (int i = 0; i < count; i++)
+            out[i] = {t[i], triIndex[i]};
+    }
+
+    // all rays head into the same octant, so one front-to-back order suits every lane,
+    // and share the dominant axis, so the triangle test matches the scalar one exactly
+    bool IsCoherent() const
+    {
+        if (!bSameAxis)
+            return false;
+        int all = (1 << width) - 1;
+        for (SimdFloat d : {dx, dy, dz})
+        {
+            int neg = MoveMask(d < SimdFloat(0.0f));
+            if (neg != 0 && neg != all)
+                return false;
+        }
+        return true;
+    }
+
+    // sign bits of the shared direction, bit 0/1/2 set for negative x/y/z
+    int Octant() const
+    {
+        return (MoveMask(dx < SimdFloat(0.0f)) & 1) |
+               ((MoveMask(dy < SimdFloat(0.0f)) & 1) << 1) |
+               ((MoveMask(dz < SimdFloat(0.0f)) & 1) << 2);
+    }
+};
+
+// lanes whose ray enters box in front of its current closest hit
+inline int PacketSlab(const RayPacket &p, const AABB &box)
+{
+    SimdFloat t1x = (SimdFloat(box.min.x) - p.ox) * p.ix;
+    SimdFloat t2x = (SimdFloat(box.max.x) - p.ox) * p.ix;
+    SimdFloat t1y = (SimdFloat(box.min.y) - p.oy) * p.iy;
+    SimdFloat t2y = (SimdFloat(box.max.y) - p.oy) * p.iy;
+    SimdFloat t1z = (SimdFloat(box.min.z) - p.oz) * p.iz;
+    SimdFloat t2z = (SimdFloat(box.max.z) - p.oz) * p.iz;
+
+    SimdFloat tNear = Max(Max(Min(t1x, t2x), Min(t1y, t2y)), Min(t1z, t2z));
+    SimdFloat tFar = Min(Min(Max(t1x, t2x), Max(t1y, t2y)), Max(t1z, t2z));
+
+    return MoveMask((tFar >= SimdFloat(0.0f)) & (tNear <= tFar) & (tNear <= p.tBest));
+}
+
+// watertight test of one triangle against every lane, the same steps as RayTriangle;
+// the axis permutation is a template argument like in the scalar test
+template <int kx, int ky, int kz>
+inline void PacketTriangleAxes(RayPacket &p, const PackedTriangle &tri, int triIdx)
+{
+    const SimdFloat o[3] = {p.ox, p.oy, p.oz};
+    SimdFloat az = SimdFloat(tri.v0[kz]) - o[kz];
+    SimdFloat ax0 = SimdFloat(tri.v0[kx]) - o[kx];
+    SimdFloat ay0 = SimdFloat(tri.v0[ky]) - o[ky];
+    SimdFloat ax = ax0 - p.sx * az, ay = ay0 - p.sy * az;
+    SimdFloat e1z(tri.e1[kz]), e2z(tri.e2[kz]);
+    SimdFloat e1x = SimdFloat(tri.e1[kx]) - p.sx * e1z, e1y = SimdFloat(tri.e1[ky]) - p.sy * e1z;
+    SimdFloat e2x = SimdFloat(tri.e2[kx]) - p.sx * e2z, e2y = SimdFloat(tri.e2[ky]) - p.sy * e2z;
+
+    SimdFloat v = e2x * ay - e2y * ax;
+    SimdFloat w = e1y * ax - e1x * ay;
+    SimdFloat det = e1x * e2y - e1y * e2x;
+    SimdFloat u = det - v - w;
+    SimdFloat dist = Max(Abs(az), Max(Abs(ax0), Abs(ay0)));
+    SimdFloat margin = SimdFloat(PackedTriangle::edgeMargin * tri.edgeScale) * (dist + SimdFloat(tri.edgeScale));
+    SimdFloat zero(0.0f), negMargin = zero - margin;
+    SimdFloat pos = (u >= negMargin) & (v >= negMargin) & (w >= negMargin);
+    SimdFloat neg = (u <= margin) & (v <= margin) & (w <= margin);
+    SimdFloat valid = (pos | neg) & ((det < zero) | (det > zero));
+    if (!MoveMask(valid))
+        return;
+
+    SimdFloat T = p.sz * (az * det + v * e1z + w * e2z);
+    T = Select(det < zero, zero - T, T);
+    det = Abs(det);
+    valid = valid & (T > zero) & (T < p.tBest * det);
+
+    int hits = MoveMask(valid);
+    if (!hits)
+        return;
+    p.tBest = Select(valid, T / det, p.tBest);
+    for (int i = 0; i < RayPacket::width; i++)
+        if (hits & (1 << i))
+            p.triIndex[i] = triIdx;
+}
+
+inline void PacketTriangle(RayPacket &p, const PackedTriangle &tri, int triIdx)
+{
+    switch (p.kz)
+    {
+    case 0: PacketTriangleAxes<1, 2, 0>(p, tri, triIdx); break;
+    case 1: PacketTriangleAxes<2, 0, 1>(p, tri, triIdx); break;
+    default: PacketTriangleAxes<0, 1, 2>(p, tri, triIdx); break;
+    }
+}
+
+// splits rays into packets for trace(RayPacket &), packets whose rays
+// diverge in direction go through the scalar Raycast instead
+template <class Trace>
+void TracePackets(const Spatial &s, const Ray *rays, int count, HitInfo *outHits, Trace trace)
+{
+    for (int first = 0; first < count; first += RayPacket::width)
+    {
+        RayPacket p;
+        p.Load(rays + first, count - first);
+        if (!p.IsCoherent())
+        {
+            s.Spatial::RaycastPacket(rays + first, p.count, outHits + first);
+            continue;
+        }
+        trace(p);
+        p.Store(outHits + first);
+    }
+}
+
+#endif
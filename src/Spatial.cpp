@@ -1,16 +1,27 @@
 
 #include "Spatial.h"
+#include "ThreadPool.h"
+#include "Grid.h"
+#include "Octree.h"
+#include "Bvh.h"
+#include "SpatialCache.h"
 
-void Spatial::ComputeBounds(AABB &out)
+#include <bit>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <ostream>
+
+void Spatial::ComputeBounds(AABB &out) const
 {
     glm::vec3 minB(FLT_MAX), maxB(-FLT_MAX);
-
-    for (int i = 0; i < triIdxList.size()/3; i++)
+    for (const PackedTriangle &p : triList)
     {
-        Triangle t = getTriangle(i);
-
+        Triangle t = p.Vertices();
         minB = glm::min(minB, glm::min(t.v0, glm::min(t.v1, t.v2)));
-        maxB = glm::max(maxB, glm::max(t.v0, glm::min(t.v1, t.v2)));
+        maxB = glm::max(maxB, glm::max(t.v0, glm::max(t.v1, t.v2)));
     }
     out = {minB, maxB};
 }
@@ -20,27 +31,297 @@ void Spatial::Build(const std::vector<Vertex> & vList, const std::vector<unsigne
     vertexList = vList;
     triIdxList = tIdxList;
     matModel = mat;
+    buildArena.Reset();
+
+    // transform every vertex once instead of once per triangle it belongs to
+    std::span<float> px = buildArena.Alloc<float>(vertexList.size());
+    std::span<float> py = buildArena.Alloc<float>(vertexList.size());
+    std::span<float> pz = buildArena.Alloc<float>(vertexList.size());
+    TransformPositions(vertexList, matModel, px, py, pz);
+
+    int numTris = (int)triIdxList.size() / 3;
+    triList.resize(numTris);
+    for (int i = 0; i < numTris; i++)
+    {
+        const unsigned int *v = &triIdxList[i * 3];
+        triList[i] = PackedTriangle(Triangle{
+            {px[v[0]], py[v[0]], pz[v[0]]},
+            {px[v[1]], py[v[1]], pz[v[1]]},
+            {px[v[2]], py[v[2]], pz[v[2]]}});
+    }
+
     ComputeBounds(bbox);
 }
 
-Triangle & Spatial::getTriangle(int triIdx)
+void Spatial::ResetTaskArenas(int numTasks)
+{
+    if ((int)taskArenas.size() < numTasks)
+        taskArenas.resize(numTasks);
+    for (int i = 0; i < numTasks; i++)
+        taskArenas[i].Reset();
+}
+
+std::unique_ptr<Spatial> CreateSpatial(SpatialType type)
+{
+    switch (type)
+    {
+    case SpatialType::Grid:
+        // resolution follows the mesh, crowded cells get a second level
+        return std::make_unique<Grid>(glm::ivec3(0), true);
+    case SpatialType::Octree:
+        return std::make_unique<Octree>();
+    case SpatialType::Lbvh:
+        return std::make_unique<Bvh>(Bvh::BuildMode::Linear);
+    case SpatialType::BvhQuantized:
+        return std::make_unique<Bvh>(Bvh::BuildMode::Sah, Bvh::NodeFormat::Quantized8);
+    case SpatialType::Bvh:
+    default:
+        return std::make_unique<Bvh>();
+    }
+}
+
+const char *SpatialTypeName(SpatialType type)
+{
+    switch (type)
+    {
+    case SpatialType::Grid:
+        return "Grid";
+    case SpatialType::Octree:
+        return "Octree";
+    case SpatialType::Lbvh:
+        return "Lbvh";
+    case SpatialType::BvhQuantized:
+        return "BvhQuantized";
+    case SpatialType::Bvh:
+    default:
+        return "Bvh";
+    }
+}
+
+void Spatial::TimedBuild(const std::vector<Vertex> & vList, const std::vector<unsigned int> & tIdxList, glm::mat4 mat)
+{
+    auto start = std::chrono::steady_clock::now();
+    Build(vList, tIdxList, mat);
+    buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void Spatial::BuildCached(const std::string &cacheDir, const std::vector<Vertex> & vList, const std::vector<unsigned int> & tIdxList, glm::mat4 mat)
+{
+    bFromCache = false;
+    std::string params = CacheParams();
+    if (cacheDir.empty() || params.empty())
+    {
+        TimedBuild(vList, tIdxList, mat);
+        return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    uint64_t key = HashBytes(&spatialCacheVersion, sizeof(spatialCacheVersion));
+    key = HashBytes(params.data(), params.size(), key);
+    for (const Vertex &v : vList)
+        key = HashBytes(&v.pos, sizeof(v.pos), key);
+    key = HashBytes(tIdxList.data(), tIdxList.size() * sizeof(unsigned int), key);
+    key = HashBytes(&mat, sizeof(mat), key);
+
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.spc", (unsigned long long)key);
+    std::filesystem::path path = std::filesystem::path(cacheDir) / name;
+
+    {
+        MappedFile file(path.string());
+        BlobReader in(file.data, file.size);
+        uint32_t magic = 0, version = 0;
+        uint64_t fileKey = 0;
+        if (file.data && in.Read(magic) && in.Read(version) && in.Read(fileKey) &&
+            magic == spatialCacheMagic && version == spatialCacheVersion && fileKey == key)
+        {
+            // the triangles come from the mesh as usual, only the structure is loaded
+            Spatial::Build(vList, tIdxList, mat);
+            if (LoadCache(in) && in.ok && in.pos == in.end)
+            {
+                bFromCache = true;
+                buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+                return;
+            }
+        }
+    }
+
+    TimedBuild(vList, tIdxList, mat);
+
+    BlobWriter out;
+    out.Write(spatialCacheMagic);
+    out.Write(spatialCacheVersion);
+    out.Write(key);
+    if (!SaveCache(out))
+        return;
+
+    // written under a name of its own first, so no reader maps half a file
+    std::error_code ec;
+    std::filesystem::create_directories(cacheDir, ec);
+    std::filesystem::path tmp = path;
+    tmp += "." + std::to_string((uintptr_t)this) + ".tmp";
+    {
+        std::ofstream f(tmp, std::ios::binary);
+        f.write((const char *)out.bytes.data(), (std::streamsize)out.bytes.size());
+        if (!f)
+        {
+            f.close();
+            std::filesystem::remove(tmp, ec);
+            return;
+        }
+    }
+    std::filesystem::rename(tmp, path, ec);
+    if (ec)
+        std::filesystem::remove(tmp, ec);
+}
+
+void Spatial::SetTransform(const glm::mat4 &mat)
+{
+    TimedBuild(vertexList, triIdxList, mat);
+}
+
+SpatialStats Spatial::Stats() const
+{
+    SpatialStats s;
+    s.type = "Spatial";
+    s.numTris = (int)triList.size();
+    s.buildMs = buildMs;
+    s.bCached = bFromCache;
+    s.bytes = VectorBytes(vertexList) + VectorBytes(triIdxList) + VectorBytes(triList);
+    s.scratchBytes = buildArena.Capacity();
+    for (const BuildArena &a : taskArenas)
+        s.scratchBytes += a.Capacity();
+    return s;
+}
+
+static float SurfaceArea(const AABB &b)
+{
+    glm::vec3 e = glm::max(b.max - b.min, glm::vec3(0.0f));
+    return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+}
+
+void SpatialStats::AddNode(const AABB &box, int depth)
+{
+    numNodes++;
+    maxDepth = std::max(maxDepth, depth);
+    sahCost += traversalCost * SurfaceArea(box);
+}
+
+void SpatialStats::AddLeaf(const AABB &box, int depth, int triCount)
+{
+    numNodes++;
+    numLeaves++;
+    numEmptyLeaves += triCount == 0;
+    numRefs += triCount;
+    maxDepth = std::max(maxDepth, depth);
+
+    if ((int)depthHistogram.size() <= depth)
+        depthHistogram.resize(depth + 1, 0);
+    depthHistogram[depth]++;
+    // bucket b holds counts in [2^(b-1), 2^b)
+    int bucket = std::bit_width((unsigned)triCount);
+    if ((int)leafHistogram.size() <= bucket)
+        leafHistogram.resize(bucket + 1, 0);
+    leafHistogram[bucket]++;
+
+    sahCost += triangleCost * triCount * SurfaceArea(box);
+}
+
+void SpatialStats::Finish(const AABB &root)
+{
+    duplication = numTris > 0 ? (float)numRefs / numTris : 0.0f;
+    float rootArea = SurfaceArea(root);
+    sahCost = rootArea > 0.0f ? sahCost / rootArea : 0.0f;
+}
+
+void SpatialStats::Print(std::ostream &os) const
 {
-    int idx = triIdx * 3;
-    glm::vec3 v0 = vertexList[triIdxList[idx]].pos;
-    glm::vec3 v1 = vertexList[triIdxList[idx+1]].pos;
-    glm::vec3 v2 = vertexList[triIdxList[idx+2]].pos;
+    os << type << ": " << numTris << " tris, " << numNodes << " nodes, " << numLeaves << " leaves ("
+       << numEmptyLeaves << " empty), depth " << maxDepth << ", " << numRefs << " refs (x" << duplication << "), "
+       << bytes / 1024 << " KB (scratch " << scratchBytes / 1024 << " KB), " << (bCached ? "loaded from cache in " : "build ") << buildMs << " ms, SAH cost "
+       << sahCost << std::endl;
 
-    v0 = glm::vec3( matModel * glm::vec4(v0, 1.0));
-    v1 = glm::vec3( matModel * glm::vec4(v1, 1.0));
-    v2 = glm::vec3( matModel * glm::vec4(v2, 1.0));
+    os << "  leaves per depth:";
+    for (int d = 0; d < (int)depthHistogram.size(); d++)
+        if (depthHistogram[d] > 0)
+            os << " " << d << ":" << depthHistogram[d];
+    os << std::endl;
 
-    return Triangle{v0, v1, v2};
+    os << "  leaves by tris:";
+    for (int b = 0; b < (int)leafHistogram.size(); b++)
+    {
+        if (leafHistogram[b] == 0)
+            continue;
+        int lo = b == 0 ? 0 : 1 << (b - 1);
+        int hi = b == 0 ? 0 : (1 << b) - 1;
+        os << " " << lo;
+        if (hi > lo)
+            os << "-" << hi;
+        os << ":" << leafHistogram[b];
+    }
+    os << std::endl;
 }
 
-void Spatial::InsertTriangles()
+void Spatial::RaycastPacket(const Ray *rays, int count, HitInfo *outHits) const
 {
-    for (int i = 0; i < triIdxList.size() / 3; i++)
-        Insert(i);
+    for (int i = 0; i < count; i++)
+    {
+        if (!Raycast(rays[i], outHits[i]))
+            outHits[i] = {FLT_MAX, -1};
+    }
+}
+
+void Spatial::RaycastBatch(std::span<const Ray> rays, std::span<HitInfo> hits) const
+{
+    // big enough to amortize scheduling, small enough to balance uneven rays
+    const int chunkSize = 256;
+    int count = (int)std::min(rays.size(), hits.size());
+    ThreadPool::Global().ParallelFor(count, chunkSize, [&](int begin, int end) {
+        RaycastPacket(rays.data() + begin, end - begin, hits.data() + begin);
+    });
+}
+
+void TransformPositions(const std::vector<Vertex> &vList, const glm::mat4 &mat,
+    std::span<float> px, std::span<float> py, std::span<float> pz)
+{
+    int n = (int)vList.size();
+    for (int i = 0; i < n; i++)
+    {
+        px[i] = vList[i].pos.x;
+        py[i] = vList[i].pos.y;
+        pz[i] = vList[i].pos.z;
+    }
+
+    // plain loops over separate arrays, so the compiler can vectorize them
+    const float m00 = mat[0][0], m01 = mat[0][1], m02 = mat[0][2];
+    const float m10 = mat[1][0], m11 = mat[1][1], m12 = mat[1][2];
+    const float m20 = mat[2][0], m21 = mat[2][1], m22 = mat[2][2];
+    const float m30 = mat[3][0], m31 = mat[3][1], m32 = mat[3][2];
+    float *x = px.data(), *y = py.data(), *z = pz.data();
+    for (int i = 0; i < n; i++)
+    {
+        float vx = x[i], vy = y[i], vz = z[i];
+        x[i] = m00 * vx + m10 * vy + m20 * vz + m30;
+        y[i] = m01 * vx + m11 * vy + m21 * vz + m31;
+        z[i] = m02 * vx + m12 * vy + m22 * vz + m32;
+    }
+}
+
+bool Spatial::SweepSphere(const glm::vec3 &from, const glm::vec3 &to, float radius, SweepHit &outHit) const
+{
+    // only triangles touching the box around the whole path can be hit
+    SweepHit best = {1.0f, glm::vec3(0.0f), -1};
+    ForEachOverlap(SweepBounds(from, to, radius), [&](int triIdx) {
+        float t;
+        glm::vec3 n;
+        if (SweepSphereTriangle(from, to - from, radius, getTriangle(triIdx), best.t, t, n))
+            best = {t, n, triIdx};
+    });
+
+    if (best.triIndex < 0)
+        return false;
+    outHit = best;
+    return true;
 }
 
 bool RayAABB(const glm::vec3 &orig, const glm::vec3 &dir, const glm::vec3 &minB, const glm::vec3 &maxB, float &tmin)
@@ -61,27 +342,541 @@ bool RayAABB(const glm::vec3 &orig, const glm::vec3 &dir, const glm::vec3 &minB,
     return true;
 }
 
+bool RaySlab(const glm::vec3 &orig, const glm::vec3 &invDir, const glm::vec3 &minB, const glm::vec3 &maxB, float tMax, float &tmin)
+{
+    glm::vec3 t1 = (minB - orig) * invDir;
+    glm::vec3 t2 = (maxB - orig) * invDir;
+    glm::vec3 tNear = glm::min(t1, t2);
+    glm::vec3 tFar = glm::max(t1, t2);
+
+    float tminCandidate = std::max({tNear.x, tNear.y, tNear.z});
+    float tmaxCandidate = std::min({tFar.x, tFar.y, tFar.z});
+
+    if (tmaxCandidate < 0 || tminCandidate > tmaxCandidate || tminCandidate > tMax)
+        return false;
+    tmin = tminCandidate;
+    return true;
+}
+
 bool RayTriangle(const Ray &ray, const Triangle &tri, float &t)
 {
-    const float EPS = 1e-6f;
-    glm::vec3 edge1 = tri.v1 - tri.v0;
-    glm::vec3 edge2 = tri.v2 - tri.v0;
-    glm::vec3 pvec = glm::cross(ray.dir, edge2);
-    float det = glm::dot(edge1, pvec);
-    if (fabs(det) < EPS)
+    return RayTriangle(WatertightRay(ray), tri, FLT_MAX, t);
+}
+
+WatertightRay::WatertightRay(const Ray &ray)
+{
+    glm::vec3 d = glm::abs(ray.dir);
+    kz = 0;
+    if (d.y > d[kz]) kz = 1;
+    if (d.z > d[kz]) kz = 2;
+    kx = (kz + 1) % 3;
+    ky = (kx + 1) % 3;
+
+    origin = ray.origin;
+    sz = 1.0f / ray.dir[kz];
+    sx = ray.dir[kx] * sz;
+    sy = ray.dir[ky] * sz;
+}
+
+PackedTriangle::PackedTriangle(const Triangle &tri)
+    : v0(tri.v0), e1(tri.v1 - tri.v0), e2(tri.v2 - tri.v0)
+{
+    glm::vec3 m = glm::max(glm::abs(e1), glm::abs(e2));
+    edgeScale = std::max(m.x, std::max(m.y, m.z));
+}
+
+// the axis permutation is a template argument so the vertex components
+// are picked at compile time instead of indexed per test
+template <int kx, int ky, int kz>
+static bool RayTriangleAxes(const WatertightRay &ray, const PackedTriangle &tri, float tMax, float &t)
+{
+    // the first vertex relative to the origin and the edges, sheared so the ray runs along +z
+    glm::vec3 a = tri.v0 - ray.origin;
+    float ax = a[kx] - ray.sx * a[kz], ay = a[ky] - ray.sy * a[kz];
+    float e1x = tri.e1[kx] - ray.sx * tri.e1[kz], e1y = tri.e1[ky] - ray.sy * tri.e1[kz];
+    float e2x = tri.e2[kx] - ray.sx * tri.e2[kz], e2y = tri.e2[ky] - ray.sy * tri.e2[kz];
+
+    // 2D edge functions: v and w of the edges leaving v0, u = det - v - w of the
+    // third. Neighbours get a shared edge from their own v0 and edges, so the
+    // values are only equal up to rounding; within the margin counts as on the
+    // edge and a ray through a seam hits both sides instead of slipping between
+    float dist = std::max(std::fabs(a.x), std::max(std::fabs(a.y), std::fabs(a.z)));
+    float margin = PackedTriangle::edgeMargin * tri.edgeScale * (dist + tri.edgeScale);
+    float v = e2x * ay - e2y * ax;
+    float w = e1y * ax - e1x * ay;
+    if (((v < -margin) | (w < -margin)) & ((v > margin) | (w > margin)))
+        return false;
+    float det = e1x * e2y - e1y * e2x;
+    float u = det - v - w;
+    if (((u < -margin) | (v < -margin) | (w < -margin)) & ((u > margin) | (v > margin) | (w > margin)))
+        return false;
+    if (det == 0)
         return false;
-    float invDet = 1.0f / det;
 
-    glm::vec3 tvec = ray.origin - tri.v0;
-    float u = glm::dot(tvec, pvec) * invDet;
-    if (u < 0 || u > 1)
+    float T = ray.sz * (a[kz] * det + v * tri.e1[kz] + w * tri.e2[kz]);
+    if (det < 0)
+    {
+        T = -T;
+        det = -det;
+    }
+    if (T <= 0 || T >= tMax * det)
         return false;
 
-    glm::vec3 qvec = glm::cross(tvec, edge1);
-    float v = glm::dot(ray.dir, qvec) * invDet;
-    if (v < 0 || u + v > 1)
+    t = T / det;
+    return true;
+}
+
+bool RayTriangle(const WatertightRay &ray, const PackedTriangle &tri, float tMax, float &t)
+{
+    switch (ray.kz)
+    {
+    case 0: return RayTriangleAxes<1, 2, 0>(ray, tri, tMax, t);
+    case 1: return RayTriangleAxes<2, 0, 1>(ray, tri, tMax, t);
+    default: return RayTriangleAxes<0, 1, 2>(ray, tri, tMax, t);
+    }
+}
+
+bool RayTriangle(const WatertightRay &ray, const Triangle &tri, float tMax, float &t)
+{
+    return RayTriangle(ray, PackedTriangle(tri), tMax, t);
+}
+
+TriangleSAT::TriangleSAT(const Triangle &tri)
+{
+    glm::vec3 e[3] = {tri.v1 - tri.v0, tri.v2 - tri.v1, tri.v0 - tri.v2};
+
+    // box face normals, triangle normal, then box axes x triangle edges
+    int k = 0;
+    axis[k++] = glm::vec3(1, 0, 0);
+    axis[k++] = glm::vec3(0, 1, 0);
+    axis[k++] = glm::vec3(0, 0, 1);
+    axis[k++] = glm::cross(e[0], e[1]);
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            glm::vec3 unit(0.0f);
+            unit[i] = 1.0f;
+            axis[k++] = glm::cross(unit, e[j]);
+        }
+    }
+
+    for (int i = 0; i < numAxes; i++)
+    {
+        float p0 = glm::dot(tri.v0, axis[i]);
+        float p1 = glm::dot(tri.v1, axis[i]);
+        float p2 = glm::dot(tri.v2, axis[i]);
+        absAxis[i] = glm::abs(axis[i]);
+        pMin[i] = std::min({p0, p1, p2});
+        pMax[i] = std::max({p0, p1, p2});
+    }
+}
+
+bool TriangleSAT::Overlaps(const AABB &box) const
+{
+    glm::vec3 c = (box.min + box.max) * 0.5f;
+    glm::vec3 h = (box.max - box.min) * 0.5f;
+
+    for (int i = 0; i < numAxes; i++)
+    {
+        float d = glm::dot(c, axis[i]);
+        float r = glm::dot(h, absAxis[i]);
+        if (pMin[i] - d > r || pMax[i] - d < -r)
+            return false;
+    }
+    return true;
+}
+
+// Ericson, Real-Time Collision Detection 5.1.5: finds the Voronoi region of p
+glm::vec3 ClosestPointTriangle(const glm::vec3 &p, const Triangle &tri)
+{
+    const glm::vec3 &a = tri.v0, &b = tri.v1, &c = tri.v2;
+    glm::vec3 ab = b - a, ac = c - a, ap = p - a;
+    float d1 = glm::dot(ab, ap), d2 = glm::dot(ac, ap);
+    if (d1 <= 0.0f && d2 <= 0.0f)
+        return a;
+
+    glm::vec3 bp = p - b;
+    float d3 = glm::dot(ab, bp), d4 = glm::dot(ac, bp);
+    if (d3 >= 0.0f && d4 <= d3)
+        return b;
+
+    float vc = d1 * d4 - d3 * d2;
+    if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f)
+        return a + ab * (d1 / (d1 - d3));
+
+    glm::vec3 cp = p - c;
+    float d5 = glm::dot(ab, cp), d6 = glm::dot(ac, cp);
+    if (d6 >= 0.0f && d5 <= d6)
+        return c;
+
+    float vb = d5 * d2 - d1 * d6;
+    if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f)
+        return a + ac * (d2 / (d2 - d6));
+
+    float va = d3 * d6 - d5 * d4;
+    if (va <= 0.0f && d4 - d3 >= 0.0f && d5 - d6 >= 0.0f)
+        return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+
+    // inside the face
+    float denom = 1.0f / (va + vb + vc);
+    return a + ab * (vb * denom) + ac * (vc * denom);
+}
+
+// first t in [0, tMax) where a point moving by move from p is radius away from center
+static bool SweepSpherePoint(const glm::vec3 &p, const glm::vec3 &move, float radius,
+    const glm::vec3 &center, float tMax, float &t)
+{
+    glm::vec3 m = p - center;
+    float a = glm::dot(move, move);
+    float b = glm::dot(m, move);
+    float c = glm::dot(m, m) - radius * radius;
+    float disc = b * b - a * c;
+    if (a <= 0.0f || disc < 0.0f)
         return false;
+    float tHit = (-b - std::sqrt(disc)) / a;
+    if (tHit < 0.0f || tHit >= tMax)
+        return false;
+    t = tHit;
+    return true;
+}
 
-    t = glm::dot(edge2, qvec) * invDet;
-    return t > EPS;
-}
\ No newline at end of file
+// the same against the infinite cylinder around edge ab, only counts inside the segment
+static bool SweepSphereEdge(const glm::vec3 &p, const glm::vec3 &move, float radius,
+    const glm::vec3 &a, const glm::vec3 &b, float tMax, float &t, float &s)
+{
+    glm::vec3 e = b - a, m = p - a;
+    float ee = glm::dot(e, e), ed = glm::dot(e, move), em = glm::dot(e, m);
+    float qa = ee * glm::dot(move, move) - ed * ed;
+    float qb = ee * glm::dot(m, move) - em * ed;
+    float qc = ee * (glm::dot(m, m) - radius * radius) - em * em;
+    float disc = qb * qb - qa * qc;
+    if (ee <= 0.0f || qa <= 0.0f || disc < 0.0f)
+        return false;
+    float tHit = (-qb - std::sqrt(disc)) / qa;
+    if (tHit < 0.0f || tHit >= tMax)
+        return false;
+    float sHit = (em + tHit * ed) / ee;
+    if (sHit < 0.0f || sHit > 1.0f)
+        return false;
+    t = tHit;
+    s = sHit;
+    return true;
+}
+
+bool SweepSphereTriangle(const glm::vec3 &from, const glm::vec3 &move, float radius,
+    const Triangle &tri, float tMax, float &t, glm::vec3 &normal)
+{
+    glm::vec3 n = glm::cross(tri.v1 - tri.v0, tri.v2 - tri.v0);
+    float nLen = glm::length(n);
+    if (nLen > 0.0f)
+        n /= nLen;
+
+    // already touching: blocked only when moving further in
+    glm::vec3 away = from - ClosestPointTriangle(from, tri);
+    float dist2 = glm::dot(away, away);
+    if (dist2 < radius * radius)
+    {
+        glm::vec3 dir = dist2 > 0.0f ? away / std::sqrt(dist2) : (glm::dot(n, move) > 0.0f ? -n : n);
+        if (tMax <= 0.0f || glm::dot(dir, move) >= 0.0f)
+            return false;
+        t = 0.0f;
+        normal = dir;
+        return true;
+    }
+
+    bool bHit = false;
+    float best = tMax;
+
+    // face: the sphere reaches the plane with its lowest point inside the triangle;
+    // a sphere already cutting the plane can only meet an edge first
+    if (nLen > 0.0f)
+    {
+        float dist = glm::dot(n, from - tri.v0);
+        if (dist < 0.0f)
+        {
+            n = -n;
+            dist = -dist;
+        }
+        float approach = glm::dot(n, move);
+        if (dist >= radius && approach < 0.0f)
+        {
+            float tFace = (radius - dist) / approach;
+            glm::vec3 p = from + move * tFace - n * radius;
+            bool bInside = glm::dot(glm::cross(tri.v1 - tri.v0, p - tri.v0), n) >= 0.0f &&
+                           glm::dot(glm::cross(tri.v2 - tri.v1, p - tri.v1), n) >= 0.0f &&
+                           glm::dot(glm::cross(tri.v0 - tri.v2, p - tri.v2), n) >= 0.0f;
+            if (bInside && tFace < best)
+            {
+                t = best = tFace;
+                normal = n;
+                // nothing on the boundary can be reached before the face
+                return true;
+            }
+        }
+    }
+
+    // edges and vertices
+    const glm::vec3 *v[3] = {&tri.v0, &tri.v1, &tri.v2};
+    for (int i = 0; i < 3; i++)
+    {
+        const glm::vec3 &a = *v[i], &b = *v[(i + 1) % 3];
+        float tHit, s;
+        if (SweepSphereEdge(from, move, radius, a, b, best, tHit, s))
+        {
+            t = best = tHit;
+            normal = (from + move * tHit - (a + (b - a) * s)) / radius;
+            bHit = true;
+        }
+        if (SweepSpherePoint(from, move, radius, a, best, tHit))
+        {
+            t = best = tHit;
+            normal = (from + move * tHit - a) / radius;
+            bHit = true;
+        }
+    }
+    if (bHit)
+        normal = glm::normalize(normal);
+    return bHit;
+}
+
+Frustum Frustum::FromMatrix(const glm::mat4 &projView)
+{
+    // Gribb/Hartmann: each plane is the last row plus or minus one of the others
+    glm::mat4 rows = glm::transpose(projView);
+    Frustum f;
+    for (int i = 0; i < 3; i++)
+    {
+        f.planes[2 * i] = rows[3] + rows[i];
+        f.planes[2 * i + 1] = rows[3] - rows[i];
+    }
+
+    glm::mat4 inv = glm::inverse(projView);
+    for (int i = 0; i < 8; i++)
+    {
+        glm::vec4 ndc((i & 1) ? 1.0f : -1.0f, (i & 2) ? 1.0f : -1.0f, (i & 4) ? 1.0f : -1.0f, 1.0f);
+        glm::vec4 p = inv * ndc;
+        f.corners[i] = glm::vec3(p) / p.w;
+    }
+    f.box = {f.corners[0], f.corners[0]};
+    for (const glm::vec3 &c : f.corners)
+    {
+        f.box.min = glm::min(f.box.min, c);
+        f.box.max = glm::max(f.box.max, c);
+    }
+    return f;
+}
+
+Frustum Frustum::Transformed(const glm::mat4 &toWorld, const glm::mat4 &fromWorld) const
+{
+    // dot(plane, toWorld * x) = dot(transpose(toWorld) * plane, x)
+    Frustum f;
+    glm::mat4 planeMat = glm::transpose(toWorld);
+    for (int i = 0; i < 6; i++)
+        f.planes[i] = planeMat * planes[i];
+    for (int i = 0; i < 8; i++)
+        f.corners[i] = glm::vec3(fromWorld * glm::vec4(corners[i], 1.0f));
+    f.box = {f.corners[0], f.corners[0]};
+    for (const glm::vec3 &c : f.corners)
+    {
+        f.box.min = glm::min(f.box.min, c);
+        f.box.max = glm::max(f.box.max, c);
+    }
+    return f;
+}
+
+bool FrustumTriangle(const Frustum &f, const Triangle &tri)
+{
+    glm::vec3 triMin = glm::min(tri.v0, glm::min(tri.v1, tri.v2));
+    glm::vec3 triMax = glm::max(tri.v0, glm::max(tri.v1, tri.v2));
+    if (!AABBIntersects({triMin, triMax}, f.box))
+        return false;
+
+    // Sutherland-Hodgman, every plane adds at most one vertex
+    glm::vec3 poly[9] = {tri.v0, tri.v1, tri.v2};
+    glm::vec3 clipped[9];
+    int count = 3;
+    for (const glm::vec4 &pl : f.planes)
+    {
+        glm::vec3 n(pl);
+        int out = 0;
+        for (int i = 0; i < count; i++)
+        {
+            const glm::vec3 &a = poly[i], &b = poly[(i + 1) % count];
+            float da = glm::dot(n, a) + pl.w;
+            float db = glm::dot(n, b) + pl.w;
+            if (da >= 0.0f)
+                clipped[out++] = a;
+            if ((da >= 0.0f) != (db >= 0.0f))
+                clipped[out++] = a + (b - a) * (da / (da - db));
+        }
+        if (out == 0)
+            return false;
+        std::copy(clipped, clipped + out, poly);
+        count = out;
+    }
+    return true;
+}
+
+bool TriangleAABB(const Triangle &tri, const AABB &box)
+{
+    // box centered on the origin
+    glm::vec3 c = (box.min + box.max) * 0.5f;
+    glm::vec3 h = (box.max - box.min) * 0.5f;
+    glm::vec3 v[3] = {tri.v0 - c, tri.v1 - c, tri.v2 - c};
+
+    // box face normals, i.e. the triangle bounds against the box
+    glm::vec3 vMin = glm::min(v[0], glm::min(v[1], v[2]));
+    glm::vec3 vMax = glm::max(v[0], glm::max(v[1], v[2]));
+    if (vMin.x > h.x || vMax.x < -h.x || vMin.y > h.y || vMax.y < -h.y || vMin.z > h.z || vMax.z < -h.z)
+        return false;
+
+    // triangle normal
+    glm::vec3 e[3] = {v[1] - v[0], v[2] - v[1], v[0] - v[2]};
+    glm::vec3 n = glm::cross(e[0], e[1]);
+    float d = glm::dot(n, v[0]);
+    float r = glm::dot(h, glm::abs(n));
+    if (d > r || d < -r)
+        return false;
+
+    // box axes x triangle edges
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            glm::vec3 unit(0.0f);
+            unit[j] = 1.0f;
+            glm::vec3 axis = glm::cross(unit, e[i]);
+            float p0 = glm::dot(v[0], axis);
+            float p1 = glm::dot(v[1], axis);
+            float p2 = glm::dot(v[2], axis);
+            r = glm::dot(h, glm::abs(axis));
+            if (std::min({p0, p1, p2}) > r || std::max({p0, p1, p2}) < -r)
+                return false;
+        }
+    }
+    return true;
+}
+
+struct MarkBuffer
+{
+    std::vector<uint32_t> stamp;
+    uint32_t epoch = 0;
+};
+
+// one buffer per nesting level, a deque so growing it keeps the others in place
+static thread_local std::deque<MarkBuffer> tlsMarks;
+static thread_local int tlsMarkDepth = 0;
+
+OverlapMarks::OverlapMarks(int numTris)
+{
+    if (tlsMarkDepth == (int)tlsMarks.size())
+        tlsMarks.emplace_back();
+    MarkBuffer &b = tlsMarks[tlsMarkDepth++];
+
+    // stamps from earlier queries are all older than the new epoch
+    if ((int)b.stamp.size() < numTris)
+        b.stamp.resize(numTris, 0);
+    if (++b.epoch == 0)
+    {
+        std::fill(b.stamp.begin(), b.stamp.end(), 0);
+        b.epoch = 1;
+    }
+    stamp = b.stamp.data();
+    epoch = b.epoch;
+}
+
+OverlapMarks::~OverlapMarks()
+{
+    tlsMarkDepth--;
+}
+
+// spreads the low 21 bits of v so there are two zero bits between any two of them
+static uint64_t ExpandBits(uint64_t v)
+{
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffull;
+    v = (v | v << 16) & 0x1f0000ff0000ffull;
+    v = (v | v << 8) & 0x100f00f00f00f00full;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+    v = (v | v << 2) & 0x1249249249249249ull;
+    return v;
+}
+
+uint64_t MortonCode(const glm::vec3 &p, const AABB &box, int bitsPerAxis)
+{
+    float cells = (float)(1u << bitsPerAxis);
+    glm::vec3 extent = glm::max(box.max - box.min, glm::vec3(FLT_MIN));
+    glm::vec3 q = glm::clamp((p - box.min) / extent * cells, glm::vec3(0.0f), glm::vec3(cells - 1.0f));
+    return ExpandBits((uint64_t)q.x) << 2 | ExpandBits((uint64_t)q.y) << 1 | ExpandBits((uint64_t)q.z);
+}
+
+void RadixSort(std::span<uint64_t> keys, std::span<int> values, BuildArena &scratch)
+{
+    const int numBuckets = 256;
+    int count = (int)keys.size();
+    if (count <= 1)
+        return;
+
+    // each chunk counts and scatters its own slice, so equal keys keep their order
+    ThreadPool &pool = ThreadPool::Global();
+    const int minChunk = 4096;
+    int numChunks = std::clamp(count / minChunk, 1, pool.Size() * 4);
+    int chunkSize = (count + numChunks - 1) / numChunks;
+
+    std::span<uint64_t> keysIn = keys, keysOut = scratch.Alloc<uint64_t>(count);
+    std::span<int> valuesIn = values, valuesOut = scratch.Alloc<int>(count);
+    std::span<int> offsets = scratch.Alloc<int>(numChunks * numBuckets);
+
+    for (int shift = 0; shift < 64; shift += 8)
+    {
+        std::fill(offsets.begin(), offsets.end(), 0);
+        pool.ParallelFor(numChunks, 1, [&](int begin, int end) {
+            for (int c = begin; c < end; c++)
+            {
+                int *hist = &offsets[c * numBuckets];
+                for (int i = c * chunkSize; i < std::min(count, (c + 1) * chunkSize); i++)
+                    hist[(keysIn[i] >> shift) & 0xff]++;
+            }
+        });
+
+        // digit-major, chunk-minor prefix sum gives every chunk its slots per digit
+        int sum = 0;
+        bool bSkip = false;
+        for (int d = 0; d < numBuckets && !bSkip; d++)
+        {
+            int digitStart = sum;
+            for (int c = 0; c < numChunks; c++)
+            {
+                int n = offsets[c * numBuckets + d];
+                offsets[c * numBuckets + d] = sum;
+                sum += n;
+            }
+            bSkip = sum - digitStart == count;
+        }
+        if (bSkip)
+            continue;
+
+        pool.ParallelFor(numChunks, 1, [&](int begin, int end) {
+            for (int c = begin; c < end; c++)
+            {
+                int *next = &offsets[c * numBuckets];
+                for (int i = c * chunkSize; i < std::min(count, (c + 1) * chunkSize); i++)
+                {
+                    int pos = next[(keysIn[i] >> shift) & 0xff]++;
+                    keysOut[pos] = keysIn[i];
+                    valuesOut[pos] = valuesIn[i];
+                }
+            }
+        });
+        std::swap(keysIn, keysOut);
+        std::swap(valuesIn, valuesOut);
+    }
+
+    // after an odd number of passes the result is in the scratch arrays
+    if (keysIn.data() != keys.data())
+    {
+        std::copy(keysIn.begin(), keysIn.end(), keys.begin());
+        std::copy(valuesIn.begin(), valuesIn.end(), values.begin());
+    }
+}
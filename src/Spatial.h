@@ -2,11 +2,22 @@
 #define __SPATIAL_H__
 
 #include <vector>
+#include <algorithm>
+#include <cfloat>
+#include <memory>
+#include <span>
+#include <cstdint>
+#include <type_traits>
+#include <string>
+#include <iosfwd>
+#include <deque>
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_inverse.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
+#include "BuildArena.h"
+
 struct Ray
 {
     glm::vec3 origin;
@@ -30,12 +41,122 @@ struct Triangle
     glm::vec3 v0, v1, v2;
 };
 
+// a triangle as the ray tests read it, set up once by Build: the first vertex,
+// the two edges leaving it and the largest edge component, which scales the
+// rounding margin of the watertight test
+struct PackedTriangle
+{
+    glm::vec3 v0, e1, e2;
+    float edgeScale;
+
+    // rounding margin of the edge functions relative to edgeScale * (distance
+    // of v0 from the origin + edgeScale), see RayTriangleAxes
+    static constexpr float edgeMargin = 1.0f / (1 << 20);
+
+    PackedTriangle() = default;
+    explicit PackedTriangle(const Triangle &tri);
+    Triangle Vertices() const { return {v0, v0 + e1, v0 + e2}; }
+};
+
+// a ray set up once for the watertight triangle test: the axes are
+// permuted so the direction is largest along kz, then sheared onto +z
+struct WatertightRay
+{
+    glm::vec3 origin;
+    int kx, ky, kz;
+    float sx, sy, sz;
+
+    WatertightRay(const Ray &ray);
+};
+
 struct HitInfo
 {
     float t;
     int triIndex;
 };
 
+struct SweepHit
+{
+    float t;            // fraction of the move done at first contact, 0 if blocked at the start
+    glm::vec3 normal;   // unit, from the contact point towards the sphere center
+    int triIndex;
+};
+
+// six planes (n, d) facing inwards, x is inside when dot(n, x) + d >= 0 for all of them
+struct Frustum
+{
+    glm::vec4 planes[6];
+    glm::vec3 corners[8];
+    AABB box;           // bounds of the corners
+
+    // the view volume of a projection * view matrix (OpenGL depth range)
+    static Frustum FromMatrix(const glm::mat4 &projView);
+    // the same volume in the space toWorld maps from; fromWorld is its inverse
+    Frustum Transformed(const glm::mat4 &toWorld, const glm::mat4 &fromWorld) const;
+};
+
+struct ClosestHit
+{
+    glm::vec3 point;    // nearest point on the surface
+    float dist;
+    int triIndex;
+};
+
+// shape and size of a built structure, for tuning and for catching degenerate
+// builds (an octree at its depth limit, a grid of mostly empty cells)
+struct SpatialStats
+{
+    // weights of the expected cost: a node step and a triangle test
+    static constexpr float traversalCost = 1.0f;
+    static constexpr float triangleCost = 1.0f;
+
+    std::string type;
+    int numTris = 0;
+    int numNodes = 0;           // inner nodes and leaves; cells of both levels for grids
+    int numLeaves = 0;
+    int numEmptyLeaves = 0;
+    int maxDepth = 0;
+    std::vector<int> depthHistogram;    // leaves per depth, grids: per level
+    std::vector<int> leafHistogram;     // leaves holding 0, 1, 2-3, 4-7, ... triangles
+    long long numRefs = 0;              // triangle references in all leaves
+    float duplication = 0.0f;           // numRefs / numTris
+    size_t bytes = 0;                   // structure and triangle data
+    size_t scratchBytes = 0;            // build arenas, kept for the next build
+    double buildMs = 0.0;
+    bool bCached = false;               // buildMs is the time to load it from the cache
+    // SAH: expected node steps and triangle tests of a ray through the root box,
+    // every node and leaf weighted by its surface area relative to the root's
+    float sahCost = 0.0f;
+
+    void AddNode(const AABB &box, int depth);
+    void AddLeaf(const AABB &box, int depth, int triCount);
+    // turns the counts into duplication and the cost, once every node is added
+    void Finish(const AABB &root);
+    void Print(std::ostream &os) const;
+};
+
+template <class T>
+size_t VectorBytes(const std::vector<T> &v)
+{
+    return v.capacity() * sizeof(T);
+}
+
+class BlobWriter;
+class BlobReader;
+
+// called for each triangle a query visits, returning false stops the query
+typedef bool (*OverlapFn)(void *ctx, int triIdx);
+
+// acceleration structure built by Mesh::initSpatial
+enum class SpatialType
+{
+    Grid,
+    Octree,
+    Bvh,
+    Lbvh,   // Bvh with the linear (Morton code) builder
+    BvhQuantized    // Bvh collapsed into 4-wide nodes with 8-bit child boxes
+};
+
 class Spatial
 {
 
@@ -48,24 +169,264 @@ public:
     std::vector<unsigned int> triIdxList = std::vector<unsigned int>();
     glm::mat4 matModel;
 
+    // triangles already transformed by matModel, filled by Build; every query
+    // reads them here, one record each so a test reads one cache line
+    std::vector<PackedTriangle> triList;
+
+    // wall time of the last TimedBuild or BuildCached
+    double buildMs = 0.0;
+    // the last BuildCached loaded the structure instead of building it
+    bool bFromCache = false;
+
+    // scratch memory of the builds, kept from one to the next; Spatial::Build
+    // resets buildArena, the parallel steps take one task arena per task
+    BuildArena buildArena;
+    std::deque<BuildArena> taskArenas;
+
     Spatial()  { }
     virtual ~Spatial() {}
 
     virtual void Build(const std::vector<Vertex> & vList, const std::vector<unsigned int> & tIdxList, glm::mat4 mat);    
-    void ComputeBounds(AABB &out);
-    void InsertTriangles();
-    Triangle & getTriangle(int triIdx);
+    // Build, timed into buildMs
+    void TimedBuild(const std::vector<Vertex> & vList, const std::vector<unsigned int> & tIdxList, glm::mat4 mat);
+    // TimedBuild, unless cacheDir holds a file with the same key (see SpatialCache.h):
+    // then only the triangles are set up and the structure is loaded. A fresh build
+    // is written back; an empty cacheDir or a backend without cache support just builds
+    void BuildCached(const std::string &cacheDir, const std::vector<Vertex> & vList, const std::vector<unsigned int> & tIdxList, glm::mat4 mat);
+
+    // what goes into the cache key besides the geometry: the backend and its build
+    // parameters; "" for backends that cannot be cached
+    virtual std::string CacheParams() const { return ""; }
+    // the arrays Build fills, written and read in the same order
+    virtual bool SaveCache(BlobWriter &) const { return false; }
+    virtual bool LoadCache(BlobReader &) { return false; }
+    // moves the geometry to a new model matrix, structures built in
+    // world space have to rebuild, object-space ones only update bounds
+    virtual void SetTransform(const glm::mat4 &mat);
+    void ComputeBounds(AABB &out) const;
+    // task arenas 0 .. numTasks - 1, reset
+    void ResetTaskArenas(int numTasks);
+    Triangle getTriangle(int triIdx) const { return triList[triIdx].Vertices(); }
+    const PackedTriangle &getPackedTriangle(int triIdx) const { return triList[triIdx]; }
 
-    virtual void Insert(int triIdx) = 0;
-    virtual bool Raycast(const Ray &ray, HitInfo &outHit)  = 0;
+    virtual bool Raycast(const Ray &ray, HitInfo &outHit) const = 0;
+    // any hit with 0 < t < tMax, stops at the first one found instead of the closest
+    virtual bool Occluded(const Ray &ray, float tMax) const = 0;
+    // traces count rays at once, a miss comes back with triIndex -1;
+    // backends with a packet path trace coherent rays SIMD-wide
+    virtual void RaycastPacket(const Ray *rays, int count, HitInfo *outHits) const;
+    // traces rays[i] into hits[i] on the shared worker pool, in packets where possible;
+    // all queries are const so any number of threads may run them at once
+    void RaycastBatch(std::span<const Ray> rays, std::span<HitInfo> hits) const;
+    // candidate triangles from the cells or nodes box touches, each once but not tested against box
     virtual void QueryAABB(const AABB &box, std::vector<int> &results) const = 0;
+
+    // moves a sphere from -> to and reports where it first touches a triangle; a
+    // triangle the sphere already touches at from only blocks moves going into it
+    virtual bool SweepSphere(const glm::vec3 &from, const glm::vec3 &to, float radius, SweepHit &outHit) const;
+
+    // nearest surface point to p closer than maxDist; the backends visit cells or
+    // nodes nearest first and skip the ones further away than the best point so far
+    virtual bool ClosestPoint(const glm::vec3 &p, float maxDist, ClosestHit &outHit) const = 0;
+
+    // calls fn once for every triangle that really touches box (exact SAT test),
+    // allocates nothing; returns false if fn stopped the query early
+    virtual bool VisitOverlaps(const AABB &box, OverlapFn fn, void *ctx) const = 0;
+
+    // calls fn once for every triangle that touches the frustum, nodes and cells
+    // inside it skip the plane tests; allocates nothing and returns false if fn
+    // stopped the query early
+    virtual bool QueryFrustum(const Frustum &f, OverlapFn fn, void *ctx) const = 0;
+
+    // counts and memory of the built structure; this one only fills in the
+    // triangle data, the backends add their nodes or cells
+    virtual SpatialStats Stats() const;
+
+    // turns a callable taking the triangle index into an OverlapFn, it may
+    // return bool (false stops) or nothing
+    template <class F>
+    static bool CallVisitor(void *ctx, int triIdx)
+    {
+        if constexpr (std::is_void_v<std::invoke_result_t<F &, int>>)
+        {
+            (*(F *)ctx)(triIdx);
+            return true;
+        }
+        else
+            return (bool)(*(F *)ctx)(triIdx);
+    }
+
+    // VisitOverlaps and QueryFrustum for any callable taking the triangle index
+    template <class Fn>
+    bool ForEachOverlap(const AABB &box, Fn &&fn) const
+    {
+        return VisitOverlaps(box, &CallVisitor<std::remove_reference_t<Fn>>, (void *)&fn);
+    }
+
+    template <class Fn>
+    bool ForEachInFrustum(const Frustum &f, Fn &&fn) const
+    {
+        return QueryFrustum(f, &CallVisitor<std::remove_reference_t<Fn>>, (void *)&fn);
+    }
+
+    // true if any triangle touches box, stops at the first one
+    bool Overlaps(const AABB &box) const
+    {
+        return !ForEachOverlap(box, [](int) { return false; });
+    }
+
+    bool InFrustum(const Frustum &f) const
+    {
+        return !ForEachInFrustum(f, [](int) { return false; });
+    }
+};
+
+// the structure Mesh builds for each type, and the type's name for logs
+std::unique_ptr<Spatial> CreateSpatial(SpatialType type);
+const char *SpatialTypeName(SpatialType type);
+
+// visited flags for queries that can meet a triangle in several cells or leaves.
+// They live in a per-thread buffer that only grows, so a warm query allocates
+// nothing; a query nested inside another one's callback gets its own buffer.
+class OverlapMarks
+{
+public:
+    explicit OverlapMarks(int numTris);
+    ~OverlapMarks();
+    OverlapMarks(const OverlapMarks &) = delete;
+    OverlapMarks &operator=(const OverlapMarks &) = delete;
+
+    // true the first time triIdx is marked in this query
+    bool Mark(int triIdx)
+    {
+        if (stamp[triIdx] == epoch)
+            return false;
+        stamp[triIdx] = epoch;
+        return true;
+    }
+
+private:
+    uint32_t *stamp;
+    uint32_t epoch;
 };
 
+// transforms all vertex positions by mat in one pass, output as x/y/z arrays
+// px, py and pz hold vList.size() floats each
+void TransformPositions(const std::vector<Vertex> &vList, const glm::mat4 &mat,
+    std::span<float> px, std::span<float> py, std::span<float> pz);
+
 bool RayAABB(const glm::vec3 &orig, const glm::vec3 &dir, 
     const glm::vec3 &minB, const glm::vec3 &maxB, float &tmin);
 
+// slab test with a precomputed 1/dir, only accepts boxes entered before tMax
+bool RaySlab(const glm::vec3 &orig, const glm::vec3 &invDir,
+    const glm::vec3 &minB, const glm::vec3 &maxB, float tMax, float &tmin);
+
 bool RayTriangle(const Ray &ray, const Triangle &tri, float &t);
 
+// watertight test (Woop, Benthin, Wald 2013), a ray through an edge shared by
+// two triangles always hits one of them; only accepts 0 < t < tMax
+bool RayTriangle(const WatertightRay &ray, const PackedTriangle &tri, float tMax, float &t);
+bool RayTriangle(const WatertightRay &ray, const Triangle &tri, float tMax, float &t);
+
+glm::vec3 ClosestPointTriangle(const glm::vec3 &p, const Triangle &tri);
+
+// squared distance from p to the nearest point of box, 0 inside
+inline float PointAABBDist2(const glm::vec3 &p, const AABB &box)
+{
+    glm::vec3 d = glm::max(glm::max(box.min - p, p - box.max), glm::vec3(0.0f));
+    return glm::dot(d, d);
+}
+
+// keeps tri in best when it is closer to p; best.dist is squared while searching
+inline void UpdateClosest(const glm::vec3 &p, const Triangle &tri, int triIdx, ClosestHit &best)
+{
+    glm::vec3 q = ClosestPointTriangle(p, tri);
+    float d2 = glm::dot(q - p, q - p);
+    if (d2 < best.dist)
+        best = {q, d2, triIdx};
+}
+
+// turns the squared distance of a finished search back into a distance
+inline bool FinishClosest(ClosestHit &best, ClosestHit &outHit)
+{
+    if (best.triIndex < 0)
+        return false;
+    best.dist = std::sqrt(best.dist);
+    outHit = best;
+    return true;
+}
+
+// sphere of radius moving by move from from against one triangle, contact at
+// 0 <= t < tMax (in units of move) through the face, an edge or a vertex
+bool SweepSphereTriangle(const glm::vec3 &from, const glm::vec3 &move, float radius,
+    const Triangle &tri, float tMax, float &t, glm::vec3 &normal);
+
+// exact separating axis test between a triangle and a box, leaves at the first
+// separating axis so most misses cost a bounds check
+bool TriangleAABB(const Triangle &tri, const AABB &box);
+
+// the same test with the triangle projections done once,
+// for binning one triangle into many boxes
+struct TriangleSAT
+{
+    static const int numAxes = 13;
+    glm::vec3 axis[numAxes];
+    glm::vec3 absAxis[numAxes];
+    float pMin[numAxes], pMax[numAxes];
+
+    TriangleSAT(const Triangle &tri);
+    bool Overlaps(const AABB &box) const;
+};
+
+// Morton code of p inside box, bitsPerAxis bits (10 or 21) of each axis interleaved x-y-z
+uint64_t MortonCode(const glm::vec3 &p, const AABB &box, int bitsPerAxis);
+
+// stable LSD radix sort of values by keys on the shared worker pool,
+// 8 bits per pass, passes where every key has the same digit are skipped;
+// the second buffers come from scratch
+void RadixSort(std::span<uint64_t> keys, std::span<int> values, BuildArena &scratch);
+
+// where a box lies against a frustum; Crossing may also come back for some
+// boxes just outside a frustum corner
+enum class FrustumSide
+{
+    Outside,
+    Crossing,
+    Inside
+};
+
+inline FrustumSide FrustumAABB(const Frustum &f, const AABB &box)
+{
+    if (box.max.x < f.box.min.x || box.min.x > f.box.max.x ||
+        box.max.y < f.box.min.y || box.min.y > f.box.max.y ||
+        box.max.z < f.box.min.z || box.min.z > f.box.max.z)
+        return FrustumSide::Outside;
+
+    // the corner furthest along each plane normal decides outside, the nearest one inside
+    bool bInside = true;
+    for (const glm::vec4 &pl : f.planes)
+    {
+        glm::vec3 n(pl);
+        glm::vec3 pos(n.x >= 0.0f ? box.max.x : box.min.x, n.y >= 0.0f ? box.max.y : box.min.y, n.z >= 0.0f ? box.max.z : box.min.z);
+        if (glm::dot(n, pos) + pl.w < 0.0f)
+            return FrustumSide::Outside;
+        glm::vec3 neg(n.x >= 0.0f ? box.min.x : box.max.x, n.y >= 0.0f ? box.min.y : box.max.y, n.z >= 0.0f ? box.min.z : box.max.z);
+        if (glm::dot(n, neg) + pl.w < 0.0f)
+            bInside = false;
+    }
+    return bInside ? FrustumSide::Inside : FrustumSide::Crossing;
+}
+
+// exact: clips the triangle by the six planes and checks something is left
+bool FrustumTriangle(const Frustum &f, const Triangle &tri);
+
+// box around the whole path of a sphere moving from -> to
+inline AABB SweepBounds(const glm::vec3 &from, const glm::vec3 &to, float radius)
+{
+    return {glm::min(from, to) - glm::vec3(radius), glm::max(from, to) + glm::vec3(radius)};
+}
+
 inline bool AABBIntersects(const AABB& a, const AABB& b)
 {
     // If one box is on left side of the other
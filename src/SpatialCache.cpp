@@ -0,0 +1,86 @@
+#include "SpatialCache.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+uint64_t HashBytes(const void *data, size_t size, uint64_t seed)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    uint64_t h = seed;
+    for (size_t i = 0; i < size; i++)
+    {
+        h ^= p[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const std::string &path)
+{
+    file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        file = nullptr;
+        return;
+    }
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+        return;
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!mapping)
+        return;
+    data = (const uint8_t *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (data)
+        size = (size_t)fileSize.QuadPart;
+}
+
+MappedFile::~MappedFile()
+{
+    if (data)
+        UnmapViewOfFile(data);
+    if (mapping)
+        CloseHandle(mapping);
+    if (file)
+        CloseHandle(file);
+}
+
+#else
+
+MappedFile::MappedFile(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+
+    // the mapping stays valid once the descriptor is closed
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        void *p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED)
+        {
+            data = (const uint8_t *)p;
+            size = (size_t)st.st_size;
+        }
+    }
+    close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+    if (data)
+        munmap((void *)data, size);
+}
+
+#endif
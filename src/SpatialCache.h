@@ -0,0 +1,102 @@
+#ifndef __SPATIALCACHE_H__
+#define __SPATIALCACHE_H__
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <type_traits>
+
+// ------------------ Spatial cache ------------------
+// A built structure is written to a file named by a hash of everything the
+// build depends on: the format version, the backend and its parameters, the
+// positions and indices, and the model matrix. A later run with the same key
+// maps the file and copies the arrays back instead of building.
+
+static const uint32_t spatialCacheMagic = 0x48435053;   // "SPCH"
+// bump whenever a backend changes what it writes
+static const uint32_t spatialCacheVersion = 1;
+
+// 64-bit FNV-1a; pass the previous result as seed to hash several buffers
+uint64_t HashBytes(const void *data, size_t size, uint64_t seed = 14695981039346656037ull);
+
+// plain data and arrays of it, back to back in one buffer
+class BlobWriter
+{
+public:
+    std::vector<uint8_t> bytes;
+
+    template <class T>
+    void Write(const T &v)
+    {
+        static_assert(std::is_trivially_copyable_v<T>, "only plain data goes into a cache file");
+        const uint8_t *p = (const uint8_t *)&v;
+        bytes.insert(bytes.end(), p, p + sizeof(T));
+    }
+
+    template <class T>
+    void WriteVector(const std::vector<T> &v)
+    {
+        static_assert(std::is_trivially_copyable_v<T>, "only plain data goes into a cache file");
+        Write((uint64_t)v.size());
+        const uint8_t *p = (const uint8_t *)v.data();
+        bytes.insert(bytes.end(), p, p + v.size() * sizeof(T));
+    }
+};
+
+// reads back what BlobWriter wrote, from memory it does not own. Every read
+// checks the bytes left, a short or damaged file only clears ok
+class BlobReader
+{
+public:
+    const uint8_t *pos;
+    const uint8_t *end;
+    bool ok = true;
+
+    BlobReader(const uint8_t *data, size_t size) : pos(data), end(data + size) {}
+
+    template <class T>
+    bool Read(T &v)
+    {
+        static_assert(std::is_trivially_copyable_v<T>, "only plain data comes from a cache file");
+        if (!ok || (size_t)(end - pos) < sizeof(T))
+            return ok = false;
+        std::memcpy(&v, pos, sizeof(T));
+        pos += sizeof(T);
+        return true;
+    }
+
+    template <class T>
+    bool ReadVector(std::vector<T> &v)
+    {
+        static_assert(std::is_trivially_copyable_v<T>, "only plain data comes from a cache file");
+        uint64_t count;
+        if (!Read(count) || count > (uint64_t)(end - pos) / sizeof(T))
+            return ok = false;
+        v.resize((size_t)count);
+        std::memcpy(v.data(), pos, (size_t)count * sizeof(T));
+        pos += count * sizeof(T);
+        return true;
+    }
+};
+
+// read-only mapping of a whole file, data is null if it could not be opened
+class MappedFile
+{
+public:
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+
+    explicit MappedFile(const std::string &path);
+    ~MappedFile();
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+private:
+#ifdef _WIN32
+    void *file = nullptr;
+    void *mapping = nullptr;
+#endif
+};
+
+#endif
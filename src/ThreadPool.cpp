@@ -0,0 +1,94 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+// set on pool threads, nested loops run serially there
+static thread_local bool tlsInPool = false;
+
+ThreadPool::ThreadPool(int numThreads)
+{
+    if (numThreads <= 0)
+        numThreads = std::max(1, (int)std::thread::hardware_concurrency());
+
+    for (int i = 0; i < numThreads - 1; i++)
+        workers.emplace_back(&ThreadPool::WorkerLoop, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m);
+        bStop = true;
+    }
+    cvStart.notify_all();
+    for (std::thread &t : workers)
+        t.join();
+}
+
+ThreadPool &ThreadPool::Global()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
+void ThreadPool::RunChunks()
+{
+    int begin;
+    while ((begin = nextIndex.fetch_add(loopChunk)) < loopCount)
+        (*loopFn)(begin, std::min(begin + loopChunk, loopCount));
+}
+
+void ThreadPool::WorkerLoop()
+{
+    tlsInPool = true;
+    unsigned long long seen = 0;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m);
+            cvStart.wait(lock, [&] { return bStop || generation != seen; });
+            if (bStop)
+                return;
+            seen = generation;
+        }
+
+        RunChunks();
+
+        std::lock_guard<std::mutex> lock(m);
+        if (--pending == 0)
+            cvDone.notify_one();
+    }
+}
+
+void ThreadPool::ParallelFor(int count, int chunkSize, const std::function<void(int, int)> &fn)
+{
+    chunkSize = std::max(1, chunkSize);
+
+    std::unique_lock<std::mutex> loopLock(loopMutex, std::defer_lock);
+    if (count <= chunkSize || workers.empty() || tlsInPool || !loopLock.try_lock())
+    {
+        for (int begin = 0; begin < count; begin += chunkSize)
+            fn(begin, std::min(begin + chunkSize, count));
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m);
+        loopFn = &fn;
+        loopCount = count;
+        loopChunk = chunkSize;
+        nextIndex = 0;
+        pending = (int)workers.size();
+        generation++;
+    }
+    cvStart.notify_all();
+
+    // the caller takes chunks as well
+    tlsInPool = true;
+    RunChunks();
+    tlsInPool = false;
+
+    std::unique_lock<std::mutex> lock(m);
+    cvDone.wait(lock, [&] { return pending == 0; });
+    loopFn = nullptr;
+}
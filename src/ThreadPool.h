@@ -0,0 +1,52 @@
+#ifndef __THREADPOOL_H__
+#define __THREADPOOL_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// ------------------ Thread pool ------------------
+// Fixed set of worker threads for data-parallel loops. ParallelFor hands out
+// chunks of an index range through one atomic counter and the calling thread
+// works along. Only one loop runs on the pool at a time, a ParallelFor issued
+// while another is running (or from inside a chunk) runs serially instead.
+class ThreadPool
+{
+public:
+    // numThreads counts the calling thread too, 0 uses every hardware thread
+    explicit ThreadPool(int numThreads = 0);
+    ~ThreadPool();
+
+    // threads taking part in a ParallelFor, including the caller
+    int Size() const { return (int)workers.size() + 1; }
+
+    // calls fn(begin, end) on chunks of [0, count) and returns once all are done
+    void ParallelFor(int count, int chunkSize, const std::function<void(int, int)> &fn);
+
+    // pool shared by the spatial code
+    static ThreadPool &Global();
+
+private:
+    void WorkerLoop();
+    void RunChunks();
+
+    std::vector<std::thread> workers;
+
+    std::mutex loopMutex;   // held by the thread running a ParallelFor
+    std::mutex m;
+    std::condition_variable cvStart, cvDone;
+    unsigned long long generation = 0;
+    int pending = 0;        // workers that have not finished the current loop
+    bool bStop = false;
+
+    // the loop being run
+    const std::function<void(int, int)> *loopFn = nullptr;
+    int loopCount = 0;
+    int loopChunk = 1;
+    std::atomic<int> nextIndex{0};
+};
+
+#endif
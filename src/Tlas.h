@@ -0,0 +1,514 @@
+#ifndef __TLAS_H__
+#define __TLAS_H__
+
+#include "Spatial.h"
+
+// ------------------ TLAS ------------------
+// Dynamic AABB tree over the world bounds of whole meshes (usually Instances),
+// so a scene query only visits the meshes whose bounds it touches. Leaves hold
+// a fattened box, a mesh that moves a little stays in its leaf and one that
+// moves further is removed and reinserted; rotations keep the tree balanced.
+class Tlas
+{
+public:
+    struct Node
+    {
+        AABB box;       // fattened for leaves, union of the children otherwise
+        int parent;
+        int left, right;
+        int instance;   // -1 for inner nodes
+        int height;     // 0 for leaves
+    };
+
+    // instance ids are positions in this list, null entries are not in the tree
+    std::vector<Spatial *> instances;
+    std::vector<int> leafOf;    // instance id -> leaf node
+    std::vector<Node> nodes;
+    std::vector<int> freeNodes;
+    int root = -1;
+
+    // leaf boxes grow by this fraction of their size on every side
+    float fatten = 0.1f;
+
+    void Build(const std::vector<Spatial *> &list)
+    {
+        instances.clear();
+        leafOf.clear();
+        nodes.clear();
+        freeNodes.clear();
+        root = -1;
+        for (Spatial *inst : list)
+            Add(inst);
+    }
+
+    // returns the new instance id, a null instance only reserves the id
+    int Add(Spatial *inst)
+    {
+        int id = (int)instances.size();
+        instances.push_back(inst);
+        leafOf.push_back(-1);
+        if (inst)
+            InsertInstance(id);
+        return id;
+    }
+
+    void Remove(int id)
+    {
+        if (leafOf[id] < 0)
+            return;
+        RemoveLeaf(leafOf[id]);
+        FreeNode(leafOf[id]);
+        leafOf[id] = -1;
+        instances[id] = nullptr;
+    }
+
+    // call after instance id moved, only reinserts it once it leaves its fat box
+    void Update(int id)
+    {
+        int leaf = leafOf[id];
+        if (leaf < 0)
+            return;
+        if (Contains(nodes[leaf].box, instances[id]->bbox))
+            return;
+
+        RemoveLeaf(leaf);
+        FreeNode(leaf);
+        InsertInstance(id);
+    }
+
+    // after many instances moved
+    void Refit()
+    {
+        for (int id = 0; id < (int)instances.size(); id++)
+            Update(id);
+    }
+
+    static float Area(const AABB &b)
+    {
+        glm::vec3 e = b.max - b.min;
+        return e.x * e.y + e.y * e.z + e.z * e.x;
+    }
+
+    static AABB Union(const AABB &a, const AABB &b)
+    {
+        return {glm::min(a.min, b.min), glm::max(a.max, b.max)};
+    }
+
+    static bool Contains(const AABB &outer, const AABB &inner)
+    {
+        return glm::all(glm::lessThanEqual(outer.min, inner.min)) &&
+               glm::all(glm::greaterThanEqual(outer.max, inner.max));
+    }
+
+    int AllocateNode()
+    {
+        if (!freeNodes.empty())
+        {
+            int n = freeNodes.back();
+            freeNodes.pop_back();
+            return n;
+        }
+        nodes.push_back({});
+        return (int)nodes.size() - 1;
+    }
+
+    void FreeNode(int n)
+    {
+        nodes[n].height = -1;
+        freeNodes.push_back(n);
+    }
+
+    void InsertInstance(int id)
+    {
+        AABB box = instances[id]->bbox;
+        glm::vec3 grow = (box.max - box.min) * fatten;
+
+        int leaf = AllocateNode();
+        nodes[leaf] = {{box.min - grow, box.max + grow}, -1, -1, -1, id, 0};
+        leafOf[id] = leaf;
+        InsertLeaf(leaf);
+    }
+
+    // walks down to the sibling that adds the least surface area, then pairs the leaf with it
+    void InsertLeaf(int leaf)
+    {
+        if (root < 0)
+        {
+            root = leaf;
+            nodes[leaf].parent = -1;
+            return;
+        }
+
+        AABB leafBox = nodes[leaf].box;
+        int index = root;
+        while (nodes[index].instance < 0)
+        {
+            const Node &node = nodes[index];
+            float area = Area(node.box);
+            float combinedArea = Area(Union(node.box, leafBox));
+
+            // cost of a new parent here, and what pushing the leaf further down adds to this node
+            float cost = 2.0f * combinedArea;
+            float inheritCost = 2.0f * (combinedArea - area);
+
+            float childCost[2];
+            int child[2] = {node.left, node.right};
+            for (int i = 0; i < 2; i++)
+            {
+                const Node &c = nodes[child[i]];
+                float grown = Area(Union(c.box, leafBox));
+                childCost[i] = (c.instance >= 0 ? grown : grown - Area(c.box)) + inheritCost;
+            }
+
+            if (cost < childCost[0] && cost < childCost[1])
+                break;
+            index = childCost[0] < childCost[1] ? child[0] : child[1];
+        }
+
+        int sibling = index;
+        int oldParent = nodes[sibling].parent;
+        int newParent = AllocateNode();
+        nodes[newParent] = {Union(leafBox, nodes[sibling].box), oldParent, sibling, leaf, -1, nodes[sibling].height + 1};
+        nodes[sibling].parent = newParent;
+        nodes[leaf].parent = newParent;
+
+        if (oldParent < 0)
+            root = newParent;
+        else if (nodes[oldParent].left == sibling)
+            nodes[oldParent].left = newParent;
+        else
+            nodes[oldParent].right = newParent;
+
+        FixUpwards(nodes[leaf].parent);
+    }
+
+    void RemoveLeaf(int leaf)
+    {
+        if (leaf == root)
+        {
+            root = -1;
+            return;
+        }
+
+        int parent = nodes[leaf].parent;
+        int grandParent = nodes[parent].parent;
+        int sibling = nodes[parent].left == leaf ? nodes[parent].right : nodes[parent].left;
+
+        nodes[sibling].parent = grandParent;
+        if (grandParent < 0)
+            root = sibling;
+        else if (nodes[grandParent].left == parent)
+            nodes[grandParent].left = sibling;
+        else
+            nodes[grandParent].right = sibling;
+        FreeNode(parent);
+
+        FixUpwards(grandParent);
+    }
+
+    // rebalances and refits every node from n up to the root
+    void FixUpwards(int n)
+    {
+        while (n >= 0)
+        {
+            n = Balance(n);
+            Node &node = nodes[n];
+            node.box = Union(nodes[node.left].box, nodes[node.right].box);
+            node.height = 1 + std::max(nodes[node.left].height, nodes[node.right].height);
+            n = node.parent;
+        }
+    }
+
+    // if one child of a is two levels taller, rotates it up; returns the node now in a's place
+    int Balance(int a)
+    {
+        const Node &A = nodes[a];
+        if (A.instance >= 0 || A.height < 2)
+            return a;
+
+        int b = A.left, c = A.right;
+        int diff = nodes[c].height - nodes[b].height;
+        if (diff > 1)
+            return RotateUp(a, c, b, false);
+        if (diff < -1)
+            return RotateUp(a, b, c, true);
+        return a;
+    }
+
+    // puts the taller child p in a's place; a keeps its other child s and takes
+    // the shorter child of p, bLeft tells on which side of a p was
+    int RotateUp(int a, int p, int s, bool bLeft)
+    {
+        Node &A = nodes[a];
+        Node &P = nodes[p];
+        int f = P.left, g = P.right;
+
+        P.parent = A.parent;
+        A.parent = p;
+        if (P.parent < 0)
+            root = p;
+        else if (nodes[P.parent].left == a)
+            nodes[P.parent].left = p;
+        else
+            nodes[P.parent].right = p;
+
+        int keep = nodes[f].height > nodes[g].height ? f : g;
+        int move = keep == f ? g : f;
+        P.left = a;
+        P.right = keep;
+        if (bLeft)
+            A.left = move;
+        else
+            A.right = move;
+        nodes[move].parent = a;
+
+        A.box = Union(nodes[s].box, nodes[move].box);
+        A.height = 1 + std::max(nodes[s].height, nodes[move].height);
+        P.box = Union(A.box, nodes[keep].box);
+        P.height = 1 + std::max(A.height, nodes[keep].height);
+        return p;
+    }
+
+    // closest hit over all instances, outInstance is the instance id
+    bool Raycast(const Ray &ray, HitInfo &outHit, int &outInstance) const
+    {
+        if (root < 0)
+            return false;
+
+        glm::vec3 invDir = 1.0f / ray.dir;
+        HitInfo best = {FLT_MAX, -1};
+        int bestInst = -1;
+
+        int stack[64];
+        int sp = 0;
+        float tNode;
+        if (RaySlab(ray.origin, invDir, nodes[root].box.min, nodes[root].box.max, best.t, tNode))
+            stack[sp++] = root;
+
+        while (sp > 0)
+        {
+            const Node &node = nodes[stack[--sp]];
+            if (node.instance >= 0)
+            {
+                HitInfo hit;
+                if (instances[node.instance]->Raycast(ray, hit) && hit.t < best.t)
+                {
+                    best = hit;
+                    bestInst = node.instance;
+                }
+                continue;
+            }
+
+            // push the far child first so the near one is visited next
+            int near = node.left, far = node.right;
+            float tNear, tFar;
+            bool hitNear = RaySlab(ray.origin, invDir, nodes[near].box.min, nodes[near].box.max, best.t, tNear);
+            bool hitFar = RaySlab(ray.origin, invDir, nodes[far].box.min, nodes[far].box.max, best.t, tFar);
+            if (hitNear && hitFar && tFar < tNear)
+            {
+                std::swap(near, far);
+                std::swap(tNear, tFar);
+            }
+            if (hitFar)
+                stack[sp++] = far;
+            if (hitNear)
+                stack[sp++] = near;
+        }
+
+        if (bestInst < 0)
+            return false;
+        outHit = best;
+        outInstance = bestInst;
+        return true;
+    }
+
+    // true if any instance is hit with 0 < t < tMax
+    bool Occluded(const Ray &ray, float tMax) const
+    {
+        if (root < 0)
+            return false;
+
+        glm::vec3 invDir = 1.0f / ray.dir;
+        int stack[64];
+        int sp = 0;
+        stack[sp++] = root;
+
+        while (sp > 0)
+        {
+            const Node &node = nodes[stack[--sp]];
+            float tNode;
+            if (!RaySlab(ray.origin, invDir, node.box.min, node.box.max, tMax, tNode))
+                continue;
+
+            if (node.instance >= 0)
+            {
+                if (instances[node.instance]->Occluded(ray, tMax))
+                    return true;
+                continue;
+            }
+
+            stack[sp++] = node.right;
+            stack[sp++] = node.left;
+        }
+        return false;
+    }
+
+    // first contact of a sphere moving from -> to over all instances
+    bool SweepSphere(const glm::vec3 &from, const glm::vec3 &to, float radius, SweepHit &outHit, int &outInstance) const
+    {
+        SweepHit best = {1.0f, glm::vec3(0.0f), -1};
+        int bestInst = -1;
+        ForEachOverlap(SweepBounds(from, to, radius), [&](int id) {
+            SweepHit hit;
+            if (instances[id]->SweepSphere(from, to, radius, hit) && hit.t < best.t)
+            {
+                best = hit;
+                bestInst = id;
+            }
+            return true;
+        });
+
+        if (bestInst < 0)
+            return false;
+        outHit = best;
+        outInstance = bestInst;
+        return true;
+    }
+
+    // nearest surface point over all instances, nearer nodes first and every
+    // instance asked only for points closer than the best one so far
+    bool ClosestPoint(const glm::vec3 &p, float maxDist, ClosestHit &outHit, int &outInstance) const
+    {
+        if (root < 0)
+            return false;
+
+        ClosestHit best = {glm::vec3(0.0f), maxDist, -1};
+        int bestInst = -1;
+        int stack[64];
+        float stackDist[64];
+        int sp = 0;
+        stack[sp] = root;
+        stackDist[sp++] = PointAABBDist2(p, nodes[root].box);
+
+        while (sp > 0)
+        {
+            sp--;
+            if (stackDist[sp] >= best.dist * best.dist)
+                continue;
+            const Node &node = nodes[stack[sp]];
+            if (node.instance >= 0)
+            {
+                ClosestHit hit;
+                if (instances[node.instance]->ClosestPoint(p, best.dist, hit) && hit.dist < best.dist)
+                {
+                    best = hit;
+                    bestInst = node.instance;
+                }
+                continue;
+            }
+
+            int near = node.left, far = node.right;
+            float dNear = PointAABBDist2(p, nodes[near].box);
+            float dFar = PointAABBDist2(p, nodes[far].box);
+            if (dFar < dNear)
+            {
+                std::swap(near, far);
+                std::swap(dNear, dFar);
+            }
+            stack[sp] = far;
+            stackDist[sp++] = dFar;
+            stack[sp] = near;
+            stackDist[sp++] = dNear;
+        }
+
+        if (bestInst < 0)
+            return false;
+        outHit = best;
+        outInstance = bestInst;
+        return true;
+    }
+
+    // calls fn(id) for the instances whose world bounds overlap box, fn returns
+    // false to stop; returns false if it did
+    template <class Fn>
+    bool ForEachOverlap(const AABB &box, Fn &&fn) const
+    {
+        if (root < 0)
+            return true;
+
+        int stack[64];
+        int sp = 0;
+        stack[sp++] = root;
+
+        while (sp > 0)
+        {
+            const Node &node = nodes[stack[--sp]];
+            if (!AABBIntersects(box, node.box))
+                continue;
+
+            if (node.instance >= 0)
+            {
+                // the leaf box is fattened, check the real bounds too
+                if (AABBIntersects(box, instances[node.instance]->bbox) && !fn(node.instance))
+                    return false;
+                continue;
+            }
+
+            stack[sp++] = node.right;
+            stack[sp++] = node.left;
+        }
+        return true;
+    }
+
+    // calls fn(id) for every instance with a triangle in the frustum, fn returns
+    // false to stop; instances wholly inside are taken without touching their triangles
+    template <class Fn>
+    bool ForEachInFrustum(const Frustum &f, Fn &&fn) const
+    {
+        if (root < 0)
+            return true;
+
+        int stack[64];
+        int sp = 0;
+        stack[sp++] = root;
+
+        while (sp > 0)
+        {
+            const Node &node = nodes[stack[--sp]];
+            if (FrustumAABB(f, node.box) == FrustumSide::Outside)
+                continue;
+
+            if (node.instance >= 0)
+            {
+                const Spatial *inst = instances[node.instance];
+                FrustumSide side = FrustumAABB(f, inst->bbox);
+                if (side == FrustumSide::Outside)
+                    continue;
+                if ((side == FrustumSide::Inside || inst->InFrustum(f)) && !fn(node.instance))
+                    return false;
+                continue;
+            }
+
+            stack[sp++] = node.right;
+            stack[sp++] = node.left;
+        }
+        return true;
+    }
+
+    // ids of the instances whose world bounds overlap box
+    void QueryAABB(const AABB &box, std::vector<int> &out) const
+    {
+        ForEachOverlap(box, [&](int id) {
+            out.push_back(id);
+            return true;
+        });
+    }
+
+    // true if a triangle of any instance touches box
+    bool Overlaps(const AABB &box) const
+    {
+        return !ForEachOverlap(box, [&](int id) { return !instances[id]->Overlaps(box); });
+    }
+};
+
+#endif
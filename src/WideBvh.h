@@ -0,0 +1,496 @@
+#ifndef __WIDEBVH_H__
+#define __WIDEBVH_H__
+
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include "Spatial.h"
+#include "RayPacket.h"
+
+// ------------------ Quantized wide BVH ------------------
+// A binary BVH collapsed into 4-wide nodes. A node keeps the boxes of its
+// children as Q-bit integers (uint8_t or uint16_t) on a grid over the node's
+// own box, so the 8-bit node fits in one 64-byte cache line and the 16-bit one
+// in two. Decoded boxes are never smaller than the real ones, queries stay exact.
+template <class Q>
+struct alignas(64) WideNode
+{
+    static const int width = 4;
+    static constexpr float qRange = (float)((1 << (8 * sizeof(Q))) - 1);
+
+    glm::vec3 origin;           // child box corner q is at origin + q * 2^exponent
+    int8_t exponent[3];
+    uint8_t numChildren;
+    Q qMin[3][width], qMax[3][width];
+    int32_t child[width];       // wide node index, first triRef for leaves
+    uint16_t triCount[width];   // 0 for inner children
+
+    bool IsLeaf(int i) const { return triCount[i] > 0; }
+
+    // 2^e built straight from the float bits, e stays in the normal range
+    static float Pow2(int e) { return std::bit_cast<float>((uint32_t)(e + 127) << 23); }
+
+    AABB ChildBox(int i) const
+    {
+        glm::vec3 scale(Pow2(exponent[0]), Pow2(exponent[1]), Pow2(exponent[2]));
+        return {origin + glm::vec3(qMin[0][i], qMin[1][i], qMin[2][i]) * scale,
+                origin + glm::vec3(qMax[0][i], qMax[1][i], qMax[2][i]) * scale};
+    }
+
+    // picks the grid for parent and rounds every child box outwards onto it
+    void Encode(const AABB &parent, const AABB *boxes, int count)
+    {
+        origin = parent.min;
+        numChildren = (uint8_t)count;
+        for (int a = 0; a < 3; a++)
+        {
+            // smallest power of two step that still spans the parent with qRange steps
+            int e;
+            std::frexp((parent.max[a] - parent.min[a]) / qRange, &e);
+            e = std::clamp(e, -126, 127);
+            while (e < 127 && origin[a] + qRange * Pow2(e) < parent.max[a])
+                e++;
+            exponent[a] = (int8_t)e;
+
+            float scale = Pow2(e);
+            for (int i = 0; i < count; i++)
+            {
+                float lo = std::clamp(std::floor((boxes[i].min[a] - origin[a]) / scale), 0.0f, qRange);
+                float hi = std::clamp(std::ceil((boxes[i].max[a] - origin[a]) / scale), 0.0f, qRange);
+                // the decode rounds too, step until the corners really are outside
+                while (lo > 0.0f && origin[a] + lo * scale > boxes[i].min[a])
+                    lo--;
+                while (hi < qRange && origin[a] + hi * scale < boxes[i].max[a])
+                    hi++;
+                qMin[a][i] = (Q)lo;
+                qMax[a][i] = (Q)hi;
+            }
+        }
+    }
+};
+
+static_assert(sizeof(WideNode<uint8_t>) == 64, "8-bit wide node should fill one cache line");
+static_assert(sizeof(WideNode<uint16_t>) == 128, "16-bit wide node should fill two cache lines");
+
+template <class Q>
+class WideBvh
+{
+public:
+    typedef WideNode<Q> Node;
+    static const int width = Node::width;
+    // every level pushes at most width - 1 nodes beside the one it pops
+    static const int stackSize = 256;
+    // deepest inner node a traversal can reach without overrunning the stack
+    static const int maxDepth = (stackSize - 1) / (width - 1);
+
+    std::vector<Node> nodes;
+
+    // collapses a binary tree: each wide node opens the inner child with the
+    // biggest surface area until it has width children. BinaryNode is Bvh::Node,
+    // whose children are leftFirst and leftFirst + 1
+    template <class BinaryNode>
+    void Collapse(const std::vector<BinaryNode> &binary)
+    {
+        nodes.clear();
+        if (binary.empty())
+            return;
+
+        // (wide node, binary node it stands for)
+        std::vector<std::pair<int, int>> todo = {{0, 0}};
+        nodes.push_back({});
+        while (!todo.empty())
+        {
+            auto [w, b] = todo.back();
+            todo.pop_back();
+
+            int slots[width];
+            int count = 0;
+            if (binary[b].triCount > 0)
+                slots[count++] = b;
+            else
+            {
+                slots[count++] = binary[b].leftFirst;
+                slots[count++] = binary[b].leftFirst + 1;
+            }
+            while (count < width)
+            {
+                int open = -1;
+                float openArea = -1.0f;
+                for (int i = 0; i < count; i++)
+                {
+                    const BinaryNode &n = binary[slots[i]];
+                    if (n.triCount == 0 && Area(n.box) > openArea)
+                    {
+                        open = i;
+                        openArea = Area(n.box);
+                    }
+                }
+                if (open < 0)
+                    break;
+                int first = binary[slots[open]].leftFirst;
+                slots[open] = first;
+                slots[count++] = first + 1;
+            }
+
+            AABB boxes[width];
+            for (int i = 0; i < count; i++)
+                boxes[i] = binary[slots[i]].box;
+            // zeroed with its padding and unused slots, the cache file is the same on every build
+            Node node;
+            std::memset(&node, 0, sizeof(Node));
+            node.Encode(binary[b].box, boxes, count);
+            for (int i = 0; i < count; i++)
+            {
+                const BinaryNode &n = binary[slots[i]];
+                if (n.triCount > 0)
+                {
+                    node.child[i] = n.leftFirst;
+                    node.triCount[i] = (uint16_t)n.triCount;
+                    continue;
+                }
+                node.child[i] = (int)nodes.size();
+                node.triCount[i] = 0;
+                nodes.push_back({});
+                todo.push_back({node.child[i], slots[i]});
+            }
+            nodes[w] = node;
+        }
+    }
+
+    static float Area(const AABB &b)
+    {
+        glm::vec3 e = b.max - b.min;
+        return e.x * e.y + e.y * e.z + e.z * e.x;
+    }
+
+    bool Raycast(const Spatial &s, const std::vector<int> &triRefs, const Ray &ray, HitInfo &outHit) const
+    {
+        if (nodes.empty())
+            return false;
+
+        glm::vec3 invDir = 1.0f / ray.dir;
+        WatertightRay wray(ray);
+        HitInfo best = {FLT_MAX, -1};
+
+        // entry distances ride along, a node is dropped once a closer hit is known
+        int stack[stackSize];
+        float stackT[stackSize];
+        int sp = 0;
+        stack[sp] = 0;
+        stackT[sp++] = 0.0f;
+
+        while (sp > 0)
+        {
+            sp--;
+            if (stackT[sp] >= best.t)
+                continue;
+            const Node &node = nodes[stack[sp]];
+
+            // leaves are tested right away, inner children are pushed far to near
+            int inner[width];
+            float innerT[width];
+            int numInner = 0;
+            for (int i = 0; i < node.numChildren; i++)
+            {
+                AABB box = node.ChildBox(i);
+                float t;
+                if (!RaySlab(ray.origin, invDir, box.min, box.max, best.t, t))
+                    continue;
+
+                if (node.IsLeaf(i))
+                {
+                    for (int r = node.child[i]; r < node.child[i] + node.triCount[i]; r++)
+                    {
+                        float tHit;
+                        if (RayTriangle(wray, s.getPackedTriangle(triRefs[r]), best.t, tHit))
+                            best = {tHit, triRefs[r]};
+                    }
+                    continue;
+                }
+
+                int k = numInner++;
+                for (; k > 0 && innerT[k - 1] < t; k--)
+                {
+                    inner[k] = inner[k - 1];
+                    innerT[k] = innerT[k - 1];
+                }
+                inner[k] = node.child[i];
+                innerT[k] = t;
+            }
+            for (int k = 0; k < numInner; k++)
+            {
+                stack[sp] = inner[k];
+                stackT[sp++] = innerT[k];
+            }
+        }
+
+        if (best.triIndex < 0)
+            return false;
+        outHit = best;
+        return true;
+    }
+
+    bool Occluded(const Spatial &s, const std::vector<int> &triRefs, const Ray &ray, float tMax) const
+    {
+        if (nodes.empty())
+            return false;
+
+        glm::vec3 invDir = 1.0f / ray.dir;
+        WatertightRay wray(ray);
+
+        int stack[stackSize];
+        int sp = 0;
+        stack[sp++] = 0;
+
+        while (sp > 0)
+        {
+            const Node &node = nodes[stack[--sp]];
+            for (int i = 0; i < node.numChildren; i++)
+            {
+                AABB box = node.ChildBox(i);
+                float t;
+                if (!RaySlab(ray.origin, invDir, box.min, box.max, tMax, t))
+                    continue;
+
+                if (!node.IsLeaf(i))
+                {
+                    stack[sp++] = node.child[i];
+                    continue;
+                }
+                for (int r = node.child[i]; r < node.child[i] + node.triCount[i]; r++)
+                {
+                    float tHit;
+                    if (RayTriangle(wray, s.getPackedTriangle(triRefs[r]), tMax, tHit))
+                        return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    // children are ordered by their centers along the packet's direction octant
+    void TracePacket(const Spatial &s, const std::vector<int> &triRefs, RayPacket &p) const
+    {
+        if (nodes.empty())
+            return;
+
+        int octant = p.Octant();
+        glm::vec3 dirSign((octant & 1) ? -1.0f : 1.0f, (octant & 2) ? -1.0f : 1.0f, (octant & 4) ? -1.0f : 1.0f);
+
+        int stack[stackSize];
+        int sp = 0;
+        stack[sp++] = 0;
+
+        while (sp > 0)
+        {
+            const Node &node = nodes[stack[--sp]];
+            int inner[width];
+            float innerKey[width];
+            int numInner = 0;
+            for (int i = 0; i < node.numChildren; i++)
+            {
+                AABB box = node.ChildBox(i);
+                if (!PacketSlab(p, box))
+                    continue;
+
+                if (node.IsLeaf(i))
+                {
+                    for (int r = node.child[i]; r < node.child[i] + node.triCount[i]; r++)
+                        PacketTriangle(p, s.getPackedTriangle(triRefs[r]), triRefs[r]);
+                    continue;
+                }
+
+                float key = glm::dot(box.min + box.max, dirSign);
+                int k = numInner++;
+                for (; k > 0 && innerKey[k - 1] < key; k--)
+                {
+                    inner[k] = inner[k - 1];
+                    innerKey[k] = innerKey[k - 1];
+                }
+                inner[k] = node.child[i];
+                innerKey[k] = key;
+            }
+            for (int k = 0; k < numInner; k++)
+                stack[sp++] = inner[k];
+        }
+    }
+
+    // calls leaf(first, count) for every leaf whose box touches box, leaf returns
+    // false to stop; returns false if it did
+    template <class Leaf>
+    bool ForEachLeaf(const AABB &box, Leaf &&leaf) const
+    {
+        if (nodes.empty())
+            return true;
+
+        int stack[stackSize];
+        int sp = 0;
+        stack[sp++] = 0;
+
+        while (sp > 0)
+        {
+            const Node &node = nodes[stack[--sp]];
+            for (int i = 0; i < node.numChildren; i++)
+            {
+                if (!AABBIntersects(box, node.ChildBox(i)))
+                    continue;
+                if (!node.IsLeaf(i))
+                    stack[sp++] = node.child[i];
+                else if (!leaf(node.child[i], (int)node.triCount[i]))
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    // calls leaf(first, count, bInside) for every leaf touching the frustum, bInside
+    // when its box is wholly inside; leaf returns false to stop
+    template <class Leaf>
+    bool ForEachLeafInFrustum(const Frustum &f, Leaf &&leaf) const
+    {
+        if (nodes.empty())
+            return true;
+
+        int stack[stackSize];
+        bool stackInside[stackSize];
+        int sp = 0;
+        stack[sp] = 0;
+        stackInside[sp++] = false;
+
+        while (sp > 0)
+        {
+            sp--;
+            const Node &node = nodes[stack[sp]];
+            bool bInside = stackInside[sp];
+            for (int i = 0; i < node.numChildren; i++)
+            {
+                FrustumSide side = bInside ? FrustumSide::Inside : FrustumAABB(f, node.ChildBox(i));
+                if (side == FrustumSide::Outside)
+                    continue;
+                if (!node.IsLeaf(i))
+                {
+                    stack[sp] = node.child[i];
+                    stackInside[sp++] = side == FrustumSide::Inside;
+                }
+                else if (!leaf(node.child[i], (int)node.triCount[i], side == FrustumSide::Inside))
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    // nearest children opened first, nodes beyond best.dist (squared) dropped
+    void ClosestPoint(const Spatial &s, const std::vector<int> &triRefs, const glm::vec3 &p, ClosestHit &best) const
+    {
+        if (nodes.empty())
+            return;
+
+        int stack[stackSize];
+        float stackDist[stackSize];
+        int sp = 0;
+        stack[sp] = 0;
+        stackDist[sp++] = 0.0f;
+
+        while (sp > 0)
+        {
+            sp--;
+            if (stackDist[sp] >= best.dist)
+                continue;
+            const Node &node = nodes[stack[sp]];
+
+            int inner[width];
+            float innerDist[width];
+            int numInner = 0;
+            for (int i = 0; i < node.numChildren; i++)
+            {
+                float d = PointAABBDist2(p, node.ChildBox(i));
+                if (d >= best.dist)
+                    continue;
+
+                if (node.IsLeaf(i))
+                {
+                    for (int r = node.child[i]; r < node.child[i] + node.triCount[i]; r++)
+                        UpdateClosest(p, s.getTriangle(triRefs[r]), triRefs[r], best);
+                    continue;
+                }
+
+                int k = numInner++;
+                for (; k > 0 && innerDist[k - 1] < d; k--)
+                {
+                    inner[k] = inner[k - 1];
+                    innerDist[k] = innerDist[k - 1];
+                }
+                inner[k] = node.child[i];
+                innerDist[k] = d;
+            }
+            for (int k = 0; k < numInner; k++)
+            {
+                stack[sp] = inner[k];
+                stackDist[sp++] = innerDist[k];
+            }
+        }
+    }
+
+    // adds every wide node and leaf to s, with the decoded (slightly larger) boxes
+    void AddStats(SpatialStats &s, const AABB &rootBox) const
+    {
+        if (nodes.empty())
+            return;
+
+        struct Entry
+        {
+            int node;
+            AABB box;
+            int depth;
+        };
+        std::vector<Entry> todo = {{0, rootBox, 0}};
+        while (!todo.empty())
+        {
+            Entry e = todo.back();
+            todo.pop_back();
+            const Node &node = nodes[e.node];
+            s.AddNode(e.box, e.depth);
+            for (int i = 0; i < node.numChildren; i++)
+            {
+                if (node.IsLeaf(i))
+                    s.AddLeaf(node.ChildBox(i), e.depth + 1, node.triCount[i]);
+                else
+                    todo.push_back({node.child[i], node.ChildBox(i), e.depth + 1});
+            }
+        }
+    }
+
+    // for trees read from a file: leaf ranges inside triRefs, inner children after
+    // their parent so there are no cycles, no node reached twice and no node
+    // deeper than maxDepth
+    bool ValidRanges(int numRefs) const
+    {
+        if (nodes.empty())
+            return true;
+        std::vector<std::pair<int, int>> todo = {{0, 0}};
+        int visited = 0;
+        while (!todo.empty())
+        {
+            auto [n, depth] = todo.back();
+            todo.pop_back();
+            const Node &node = nodes[n];
+            if (depth > maxDepth || ++visited > (int)nodes.size() || node.numChildren > width)
+                return false;
+            for (int i = 0; i < node.numChildren; i++)
+            {
+                if (node.IsLeaf(i))
+                {
+                    if (node.child[i] < 0 || (int64_t)node.child[i] + node.triCount[i] > numRefs)
+                        return false;
+                    continue;
+                }
+                if (node.child[i] <= n || node.child[i] >= (int)nodes.size())
+                    return false;
+                todo.push_back({node.child[i], depth + 1});
+            }
+        }
+        return true;
+    }
+};
+
+#endif
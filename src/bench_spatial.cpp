@@ -0,0 +1,578 @@
+// headless benchmark of the Spatial backends: build time, ray and box query
+// throughput, memory, and agreement with a brute-force oracle. No GL, the
+// models are read with the same assimp flags as Mesh::loadModel. A second
+// part moves many instances every frame and compares the two scene indices,
+// Tlas and LooseOctree, the same way.
+//
+// usage: bench_spatial [--models dir] [--rays n] [--queries n] [--oracle n]
+//                      [--objects n] [--frames n] [--seed s] [--out file.json]
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cmath>
+
+#include <assimp/scene.h>
+#include <assimp/Importer.hpp>
+#include <assimp/postprocess.h>
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "Spatial.h"
+#include "ThreadPool.h"
+#include "Instance.h"
+#include "Tlas.h"
+#include "LooseOctree.h"
+
+static const char *benchModels[] = {
+    "bunny_normal.obj",
+    "Winter_Mug_Low_Poly.obj",
+    "teapot.obj",
+    "MedievalHouse/roof.obj",
+    "MedievalHouse/wall-paint.obj",
+    "MedievalHouse/wall-paint-door.obj",
+    "MedievalHouse/wall-paint-window.obj"};
+
+// instanced by the scene part
+static const char *sceneModel = "teapot.obj";
+
+static const SpatialType benchTypes[] = {
+    SpatialType::Grid,
+    SpatialType::Octree,
+    SpatialType::Bvh,
+    SpatialType::Lbvh,
+    SpatialType::BvhQuantized};
+
+struct BenchOptions
+{
+    std::string modelDir = "models";
+    std::string outPath;        // JSON to stdout when empty
+    int numRays = 1 << 20;      // per ray set, random and coherent
+    int numQueries = 100000;
+    int numOracle = 1000;       // rays and boxes of each set checked against brute force
+    unsigned seed = 1;
+    int builds = 3;             // the fastest build and rebuild are reported
+    int numObjects = 4096;      // instances of the scene part, all moving
+    int numFrames = 10;
+};
+
+struct BenchResult
+{
+    std::string model;
+    std::string backend;
+    int numTris = 0;
+    double buildMs = 0.0;
+    double rebuildMs = 0.0;     // SetTransform on the built structure, its arenas reused
+    size_t bytes = 0;
+    size_t scratchBytes = 0;
+    float sahCost = 0.0f;
+    double randomMrays = 0.0;
+    double coherentMrays = 0.0;
+    double queriesPerSec = 0.0;
+    long long overlaps = 0;     // triangles found by all box queries, equal for every backend
+    int rayChecks = 0, rayAgree = 0;
+    int queryChecks = 0, queryAgree = 0;
+};
+
+struct SceneResult
+{
+    std::string index;
+    int numObjects = 0;
+    double buildMs = 0.0;
+    double updateMs = 0.0;      // per frame, every object moved
+    double raysPerSec = 0.0;
+    double queriesPerSec = 0.0;
+    int rayChecks = 0, rayAgree = 0;
+    int queryChecks = 0, queryAgree = 0;
+};
+
+static double MsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// positions and indices of every mesh of the file, as Mesh::loadModel joins them
+static bool LoadPositions(const std::string &path, std::vector<Vertex> &vertices, std::vector<unsigned int> &indices)
+{
+    Assimp::Importer importer;
+    const aiScene *scene = importer.ReadFile(path, aiProcess_JoinIdenticalVertices | aiProcess_FlipUVs | aiProcess_Triangulate);
+    if (scene == NULL || scene->mRootNode == NULL)
+    {
+        std::cerr << "load model failed: " << importer.GetErrorString() << std::endl;
+        return false;
+    }
+
+    for (unsigned int i = 0; i < scene->mNumMeshes; i++)
+    {
+        aiMesh *mesh = scene->mMeshes[i];
+        if (!mesh)
+            continue;
+        unsigned int baseVertex = (unsigned int)vertices.size();
+        for (unsigned int j = 0; j < mesh->mNumVertices; j++)
+        {
+            Vertex v = {};
+            v.pos = glm::vec3(mesh->mVertices[j].x, mesh->mVertices[j].y, mesh->mVertices[j].z);
+            vertices.push_back(v);
+        }
+        for (unsigned int j = 0; j < mesh->mNumFaces; j++)
+        {
+            const aiFace &face = mesh->mFaces[j];
+            if (face.mNumIndices != 3)
+                continue;
+            for (unsigned int k = 0; k < 3; k++)
+                indices.push_back(baseVertex + face.mIndices[k]);
+        }
+    }
+    return !indices.empty();
+}
+
+// rays from a sphere around the model towards random points inside its box
+static void RandomRays(const AABB &box, int count, std::mt19937 &rng, std::vector<Ray> &rays)
+{
+    std::uniform_real_distribution<float> u(-1.0f, 1.0f);
+    glm::vec3 center = (box.min + box.max) * 0.5f;
+    glm::vec3 half = (box.max - box.min) * 0.5f;
+    float radius = glm::length(half) * 2.0f + 1e-3f;
+
+    rays.resize(count);
+    for (Ray &ray : rays)
+    {
+        glm::vec3 d;
+        do
+            d = glm::vec3(u(rng), u(rng), u(rng));
+        while (glm::dot(d, d) > 1.0f || glm::dot(d, d) < 1e-4f);
+        glm::vec3 origin = center + glm::normalize(d) * radius;
+        glm::vec3 target = center + glm::vec3(u(rng), u(rng), u(rng)) * half;
+        ray = {origin, glm::normalize(target - origin)};
+    }
+}
+
+// primary rays of a pinhole camera framing the model, in scanline order
+static void CameraRays(const AABB &box, int count, std::vector<Ray> &rays)
+{
+    glm::vec3 center = (box.min + box.max) * 0.5f;
+    float radius = glm::length(box.max - box.min) * 0.5f + 1e-3f;
+    glm::vec3 eye = center + glm::normalize(glm::vec3(0.6f, 0.4f, 1.0f)) * radius * 2.5f;
+    glm::mat4 view = glm::lookAt(eye, center, glm::vec3(0.0f, 1.0f, 0.0f));
+    glm::mat3 toWorld = glm::transpose(glm::mat3(view));
+
+    int width = std::max(1, (int)std::sqrt((double)count));
+    int height = std::max(1, count / width);
+    float tanHalf = std::tan(glm::radians(45.0f) * 0.5f);
+    rays.resize((size_t)width * height);
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+        {
+            glm::vec3 d = {(2.0f * (x + 0.5f) / width - 1.0f) * tanHalf,
+                           (1.0f - 2.0f * (y + 0.5f) / height) * tanHalf, -1.0f};
+            rays[(size_t)y * width + x] = {eye, glm::normalize(toWorld * d)};
+        }
+}
+
+// boxes centered inside the model, up to 5% of its diagonal on each side
+static void RandomBoxes(const AABB &box, int count, std::mt19937 &rng, std::vector<AABB> &boxes)
+{
+    std::uniform_real_distribution<float> u(-1.0f, 1.0f), e(0.0f, 1.0f);
+    glm::vec3 center = (box.min + box.max) * 0.5f;
+    glm::vec3 half = (box.max - box.min) * 0.5f;
+    float size = glm::length(box.max - box.min) * 0.05f;
+
+    boxes.resize(count);
+    for (AABB &b : boxes)
+    {
+        glm::vec3 c = center + glm::vec3(u(rng), u(rng), u(rng)) * half;
+        glm::vec3 r = glm::vec3(e(rng), e(rng), e(rng)) * size;
+        b = {c - r, c + r};
+    }
+}
+
+static HitInfo OracleRay(const std::vector<Triangle> &tris, const Ray &ray)
+{
+    WatertightRay wray(ray);
+    HitInfo best = {FLT_MAX, -1};
+    for (int i = 0; i < (int)tris.size(); i++)
+    {
+        float t;
+        if (RayTriangle(wray, tris[i], best.t, t))
+            best = {t, i};
+    }
+    return best;
+}
+
+// same hit or miss, and the same distance; the triangle may differ on shared edges
+static bool SameHit(const HitInfo &a, const HitInfo &b)
+{
+    if ((a.triIndex < 0) != (b.triIndex < 0))
+        return false;
+    return a.triIndex < 0 || std::fabs(a.t - b.t) <= 1e-4f * std::max(1.0f, b.t);
+}
+
+static void BenchModel(const BenchOptions &opt, const std::string &name, std::vector<BenchResult> &results)
+{
+    std::vector<Vertex> vertices;
+    std::vector<unsigned int> indices;
+    if (!LoadPositions(opt.modelDir + "/" + name, vertices, indices))
+        return;
+
+    // the query sets and their brute-force answers are shared by every backend
+    std::unique_ptr<Spatial> reference = CreateSpatial(SpatialType::Bvh);
+    reference->Build(vertices, indices, glm::mat4(1.0f));
+    std::vector<Triangle> tris(reference->triList.size());
+    for (int i = 0; i < (int)tris.size(); i++)
+        tris[i] = reference->getTriangle(i);
+    AABB box = reference->bbox;
+
+    std::mt19937 rng(opt.seed);
+    std::vector<Ray> randomRays, cameraRays;
+    std::vector<AABB> boxes;
+    RandomRays(box, opt.numRays, rng, randomRays);
+    CameraRays(box, opt.numRays, cameraRays);
+    RandomBoxes(box, opt.numQueries, rng, boxes);
+
+    // every stride-th ray and box is checked
+    int rayStride = std::max(1, opt.numRays / std::max(1, opt.numOracle));
+    int boxStride = std::max(1, opt.numQueries / std::max(1, opt.numOracle));
+    std::vector<HitInfo> oracleRandom, oracleCamera;
+    for (int i = 0; i < (int)randomRays.size(); i += rayStride)
+        oracleRandom.push_back(OracleRay(tris, randomRays[i]));
+    for (int i = 0; i < (int)cameraRays.size(); i += rayStride)
+        oracleCamera.push_back(OracleRay(tris, cameraRays[i]));
+    std::vector<int> oracleBoxes;
+    for (int i = 0; i < (int)boxes.size(); i += boxStride)
+    {
+        int count = 0;
+        for (const Triangle &t : tris)
+            count += TriangleAABB(t, boxes[i]);
+        oracleBoxes.push_back(count);
+    }
+
+    std::vector<HitInfo> hits(std::max(randomRays.size(), cameraRays.size()));
+    for (SpatialType type : benchTypes)
+    {
+        BenchResult r = {};
+        r.model = name;
+        r.backend = SpatialTypeName(type);
+        r.numTris = (int)tris.size();
+
+        std::unique_ptr<Spatial> spatial;
+        r.buildMs = DBL_MAX;
+        for (int b = 0; b < std::max(1, opt.builds); b++)
+        {
+            spatial = CreateSpatial(type);
+            spatial->TimedBuild(vertices, indices, glm::mat4(1.0f));
+            r.buildMs = std::min(r.buildMs, spatial->buildMs);
+        }
+        r.rebuildMs = DBL_MAX;
+        for (int b = 0; b < std::max(1, opt.builds); b++)
+        {
+            spatial->SetTransform(glm::mat4(1.0f));
+            r.rebuildMs = std::min(r.rebuildMs, spatial->buildMs);
+        }
+        SpatialStats stats = spatial->Stats();
+        r.bytes = stats.bytes;
+        r.scratchBytes = stats.scratchBytes;
+        r.sahCost = stats.sahCost;
+
+        auto traceSet = [&](const std::vector<Ray> &rays, const std::vector<HitInfo> &oracle) {
+            auto start = std::chrono::steady_clock::now();
+            spatial->RaycastBatch(rays, std::span<HitInfo>(hits.data(), rays.size()));
+            double ms = MsSince(start);
+            for (int i = 0, k = 0; i < (int)rays.size(); i += rayStride, k++)
+            {
+                r.rayChecks++;
+                r.rayAgree += SameHit(hits[i], oracle[k]);
+            }
+            return rays.size() / (ms * 1000.0);
+        };
+        r.randomMrays = traceSet(randomRays, oracleRandom);
+        r.coherentMrays = traceSet(cameraRays, oracleCamera);
+
+        // box queries run one after another on this thread, as the app issues them
+        auto start = std::chrono::steady_clock::now();
+        for (const AABB &b : boxes)
+            spatial->ForEachOverlap(b, [&](int) { r.overlaps++; });
+        r.queriesPerSec = boxes.size() / (MsSince(start) / 1000.0);
+        for (int i = 0, k = 0; i < (int)boxes.size(); i += boxStride, k++)
+        {
+            int count = 0;
+            spatial->ForEachOverlap(boxes[i], [&](int) { count++; });
+            r.queryChecks++;
+            r.queryAgree += count == oracleBoxes[k];
+        }
+
+        std::cerr << name << " " << r.backend << ": build " << r.buildMs << " ms, rebuild " << r.rebuildMs << " ms, " << r.randomMrays << " / "
+                  << r.coherentMrays << " Mrays/s, " << r.queriesPerSec << " queries/s, rays " << r.rayAgree << "/"
+                  << r.rayChecks << ", boxes " << r.queryAgree << "/" << r.queryChecks << std::endl;
+        results.push_back(r);
+    }
+}
+
+// a scene object drifting through the world box, it bounces off the sides
+struct SceneMotion
+{
+    glm::vec3 pos;
+    glm::vec3 vel;
+    glm::vec3 axis;
+    float angle;
+};
+
+static glm::mat4 MotionMatrix(const SceneMotion &m)
+{
+    return glm::rotate(glm::translate(glm::mat4(1.0f), m.pos), m.angle, m.axis);
+}
+
+// closest object along the ray by testing every one, triIndex is the object id
+static HitInfo OracleSceneRay(const std::vector<Spatial *> &objects, const Ray &ray)
+{
+    HitInfo best = {FLT_MAX, -1};
+    for (int i = 0; i < (int)objects.size(); i++)
+    {
+        HitInfo hit;
+        if (objects[i]->Raycast(ray, hit) && hit.t < best.t)
+            best = {hit.t, i};
+    }
+    return best;
+}
+
+// one index over the moving objects; Update and the queries have the same
+// signatures on Tlas and LooseOctree
+template <class Index>
+struct SceneIndex
+{
+    Index index;
+    SceneResult r;
+    double updateMs = 0.0, rayMs = 0.0, queryMs = 0.0;
+
+    void Frame(const std::vector<Spatial *> &objects, const std::vector<Ray> &rays, const std::vector<AABB> &boxes,
+               int rayStride, int boxStride, const std::vector<HitInfo> &oracleRays, const std::vector<int> &oracleBoxes)
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (int id = 0; id < (int)objects.size(); id++)
+            index.Update(id);
+        updateMs += MsSince(start);
+
+        std::vector<HitInfo> hits(rays.size());
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < (int)rays.size(); i++)
+        {
+            int id;
+            if (!index.Raycast(rays[i], hits[i], id))
+                hits[i] = {FLT_MAX, -1};
+        }
+        rayMs += MsSince(start);
+        for (int i = 0, k = 0; i < (int)rays.size(); i += rayStride, k++)
+        {
+            r.rayChecks++;
+            r.rayAgree += SameHit(hits[i], oracleRays[k]);
+        }
+
+        std::vector<int> counts(boxes.size(), 0);
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < (int)boxes.size(); i++)
+            index.ForEachOverlap(boxes[i], [&](int) {
+                counts[i]++;
+                return true;
+            });
+        queryMs += MsSince(start);
+        for (int i = 0, k = 0; i < (int)boxes.size(); i += boxStride, k++)
+        {
+            r.queryChecks++;
+            r.queryAgree += counts[i] == oracleBoxes[k];
+        }
+    }
+
+    // averages over the frames, numRays rays and numBoxes boxes each
+    const SceneResult &Finish(int frames, int numRays, int numBoxes)
+    {
+        r.updateMs = updateMs / frames;
+        r.raysPerSec = (double)numRays * frames / (rayMs / 1000.0);
+        r.queriesPerSec = (double)numBoxes * frames / (queryMs / 1000.0);
+        return r;
+    }
+};
+
+// many instances of one model, every one moves every frame. Tlas keeps tight
+// boxes and rebalances on reinsertion, the loose octree places an object by its
+// size and center alone; which one wins depends on how much of the scene moves
+static void BenchScene(const BenchOptions &opt, std::vector<SceneResult> &results)
+{
+    std::vector<Vertex> vertices;
+    std::vector<unsigned int> indices;
+    if (opt.numObjects <= 0 || !LoadPositions(opt.modelDir + "/" + sceneModel, vertices, indices))
+        return;
+    std::shared_ptr<Spatial> blas = CreateSpatial(SpatialType::Bvh);
+    blas->Build(vertices, indices, glm::mat4(1.0f));
+
+    // about 27 object sizes of room per object, each frame moves up to half a size
+    glm::vec3 ext = blas->bbox.max - blas->bbox.min;
+    float size = std::max(ext.x, std::max(ext.y, ext.z));
+    float side = size * 3.0f * std::cbrt((float)opt.numObjects);
+    AABB world = {glm::vec3(0.0f), glm::vec3(side)};
+
+    std::mt19937 rng(opt.seed);
+    std::uniform_real_distribution<float> u(0.0f, 1.0f), v(-1.0f, 1.0f);
+    std::vector<SceneMotion> motion(opt.numObjects);
+    std::vector<std::unique_ptr<Instance>> instances;
+    std::vector<Spatial *> objects;
+    for (SceneMotion &m : motion)
+    {
+        m.pos = glm::vec3(u(rng), u(rng), u(rng)) * side;
+        m.vel = glm::vec3(v(rng), v(rng), v(rng)) * size * 0.5f;
+        m.axis = glm::normalize(glm::vec3(v(rng), v(rng), v(rng)) + glm::vec3(1e-3f));
+        m.angle = u(rng) * 6.2831853f;
+        instances.push_back(std::make_unique<Instance>(blas, MotionMatrix(m)));
+        objects.push_back(instances.back().get());
+    }
+
+    SceneIndex<Tlas> tlas;
+    SceneIndex<LooseOctree> octree;
+    tlas.r.index = "Tlas";
+    octree.r.index = "LooseOctree";
+    tlas.r.numObjects = octree.r.numObjects = opt.numObjects;
+    auto start = std::chrono::steady_clock::now();
+    tlas.index.Build(objects);
+    tlas.r.buildMs = MsSince(start);
+    start = std::chrono::steady_clock::now();
+    octree.index.Build(objects);
+    octree.r.buildMs = MsSince(start);
+
+    int numRays = std::max(1, opt.numRays / 16);
+    int numBoxes = std::max(1, opt.numQueries / 10);
+    int rayStride = std::max(1, numRays / std::max(1, opt.numOracle));
+    int boxStride = std::max(1, numBoxes / std::max(1, opt.numOracle));
+    int frames = std::max(1, opt.numFrames);
+    std::vector<Ray> rays;
+    std::vector<AABB> boxes;
+    for (int frame = 0; frame < frames; frame++)
+    {
+        for (int i = 0; i < opt.numObjects; i++)
+        {
+            SceneMotion &m = motion[i];
+            m.pos += m.vel;
+            for (int a = 0; a < 3; a++)
+                if ((m.pos[a] < 0.0f && m.vel[a] < 0.0f) || (m.pos[a] > side && m.vel[a] > 0.0f))
+                    m.vel[a] = -m.vel[a];
+            m.angle += 0.05f;
+            instances[i]->SetTransform(MotionMatrix(m));
+        }
+
+        RandomRays(world, numRays, rng, rays);
+        RandomBoxes(world, numBoxes, rng, boxes);
+        std::vector<HitInfo> oracleRays;
+        for (int i = 0; i < numRays; i += rayStride)
+            oracleRays.push_back(OracleSceneRay(objects, rays[i]));
+        std::vector<int> oracleBoxes;
+        for (int i = 0; i < numBoxes; i += boxStride)
+        {
+            int count = 0;
+            for (const Spatial *s : objects)
+                count += AABBIntersects(boxes[i], s->bbox);
+            oracleBoxes.push_back(count);
+        }
+
+        tlas.Frame(objects, rays, boxes, rayStride, boxStride, oracleRays, oracleBoxes);
+        octree.Frame(objects, rays, boxes, rayStride, boxStride, oracleRays, oracleBoxes);
+    }
+
+    for (const SceneResult &r : {tlas.Finish(frames, numRays, numBoxes), octree.Finish(frames, numRays, numBoxes)})
+    {
+        std::cerr << "scene " << r.index << ": " << r.numObjects << " objects, build " << r.buildMs << " ms, update "
+                  << r.updateMs << " ms/frame, " << r.raysPerSec << " rays/s, " << r.queriesPerSec << " queries/s, rays "
+                  << r.rayAgree << "/" << r.rayChecks << ", boxes " << r.queryAgree << "/" << r.queryChecks << std::endl;
+        results.push_back(r);
+    }
+}
+
+static void WriteJson(std::ostream &os, const BenchOptions &opt, const std::vector<BenchResult> &results,
+                      const std::vector<SceneResult> &scene)
+{
+    os << "{\n";
+    os << "  \"seed\": " << opt.seed << ",\n";
+    os << "  \"rays\": " << opt.numRays << ",\n";
+    os << "  \"queries\": " << opt.numQueries << ",\n";
+    os << "  \"threads\": " << ThreadPool::Global().Size() << ",\n";
+    os << "  \"results\": [";
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchResult &r = results[i];
+        os << (i ? ",\n" : "\n");
+        os << "    {\"model\": \"" << r.model << "\", \"backend\": \"" << r.backend << "\", \"tris\": " << r.numTris
+           << ", \"buildMs\": " << r.buildMs << ", \"rebuildMs\": " << r.rebuildMs << ", \"bytes\": " << r.bytes
+           << ", \"scratchBytes\": " << r.scratchBytes << ", \"sahCost\": " << r.sahCost
+           << ", \"randomMrays\": " << r.randomMrays << ", \"coherentMrays\": " << r.coherentMrays
+           << ", \"queriesPerSec\": " << r.queriesPerSec << ", \"overlaps\": " << r.overlaps
+           << ", \"rayAgreement\": " << (r.rayChecks ? (double)r.rayAgree / r.rayChecks : 1.0)
+           << ", \"queryAgreement\": " << (r.queryChecks ? (double)r.queryAgree / r.queryChecks : 1.0) << "}";
+    }
+    os << "\n  ],\n";
+    os << "  \"scene\": [";
+    for (size_t i = 0; i < scene.size(); i++)
+    {
+        const SceneResult &r = scene[i];
+        os << (i ? ",\n" : "\n");
+        os << "    {\"index\": \"" << r.index << "\", \"objects\": " << r.numObjects << ", \"buildMs\": " << r.buildMs
+           << ", \"updateMs\": " << r.updateMs << ", \"raysPerSec\": " << r.raysPerSec
+           << ", \"queriesPerSec\": " << r.queriesPerSec
+           << ", \"rayAgreement\": " << (r.rayChecks ? (double)r.rayAgree / r.rayChecks : 1.0)
+           << ", \"queryAgreement\": " << (r.queryChecks ? (double)r.queryAgree / r.queryChecks : 1.0) << "}";
+    }
+    os << "\n  ]\n}\n";
+}
+
+int main(int argc, char **argv)
+{
+    BenchOptions opt;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        bool bHasValue = i + 1 < argc;
+        if (arg == "--models" && bHasValue)
+            opt.modelDir = argv[++i];
+        else if (arg == "--out" && bHasValue)
+            opt.outPath = argv[++i];
+        else if (arg == "--rays" && bHasValue)
+            opt.numRays = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--queries" && bHasValue)
+            opt.numQueries = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--oracle" && bHasValue)
+            opt.numOracle = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--objects" && bHasValue)
+            opt.numObjects = std::max(0, std::atoi(argv[++i]));
+        else if (arg == "--frames" && bHasValue)
+            opt.numFrames = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--seed" && bHasValue)
+            opt.seed = (unsigned)std::atoi(argv[++i]);
+        else
+        {
+            std::cerr << "usage: bench_spatial [--models dir] [--rays n] [--queries n] [--oracle n] [--objects n] [--frames n] "
+                         "[--seed s] [--out file.json]" << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector<BenchResult> results;
+    for (const char *name : benchModels)
+        BenchModel(opt, name, results);
+    std::vector<SceneResult> scene;
+    BenchScene(opt, scene);
+
+    if (opt.outPath.empty())
+        WriteJson(std::cout, opt, results, scene);
+    else
+    {
+        std::ofstream out(opt.outPath);
+        WriteJson(out, opt, results, scene);
+    }
+
+    // every backend has to agree with the oracle, or the numbers mean nothing
+    for (const BenchResult &r : results)
+        if (r.rayAgree != r.rayChecks || r.queryAgree != r.queryChecks)
+            return 2;
+    for (const SceneResult &r : scene)
+        if (r.rayAgree != r.rayChecks || r.queryAgree != r.queryChecks)
+            return 2;
+    return results.empty() ? 1 : 0;
+}
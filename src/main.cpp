@@ -10,6 +10,7 @@
 
 #include "shader.h"
 #include "Mesh.h"
+#include "Tlas.h"
 //#include "Node.h"
 
 
@@ -43,10 +44,55 @@ static bool gFloorWireframe = false;
 // Current picked mesh index (for basic object movement)
 static int gPickedIndex = -1;
 
+// where the left button went down, a drag from there selects by rectangle
+static double gDragStartX = 0.0, gDragStartY = 0.0;
+// triangles of the picked mesh chosen by an ALT + drag
+static std::vector<int> gSelectedTris;
+
+// acceleration structure used for picking and collision on every mesh;
+// Lbvh rebuilds fastest when meshes are not instanced and move a lot
+static SpatialType gSpatialType = SpatialType::Bvh;
+// meshes loaded from the same file share one object-space structure
+static bool gInstanced = true;
+
 // We are using mesh list instead of scene graph to demo our picking and collision detection
 std::vector< std::shared_ptr <Mesh> > meshList;
 std::vector< glm::mat4 > meshMatList;
 
+// top-level structure over the world bounds of every mesh in meshList
+static Tlas gTlas;
+
+static void BuildSceneTlas()
+{
+    std::vector<Spatial *> list;
+    for (auto &pMesh : meshList)
+        list.push_back(pMesh ? pMesh->pSpatial.get() : nullptr);
+    gTlas.Build(list);
+}
+
+// moves a sphere by move through the scene, sliding along whatever it touches;
+// returns where it ends up
+static glm::vec3 SlideSphere(glm::vec3 pos, glm::vec3 move, float radius)
+{
+    // stop this far short of a contact so the next sweep does not start inside
+    const float skin = 0.01f;
+    for (int i = 0; i < 3 && glm::length(move) > skin; i++)
+    {
+        SweepHit hit;
+        int instance;
+        if (!gTlas.SweepSphere(pos, pos + move, radius, hit, instance))
+            return pos + move;
+
+        float len = glm::length(move);
+        pos += move * std::max(0.0f, hit.t - skin / len);
+
+        // keep what is left of the move along the surface
+        move *= 1.0f - hit.t;
+        move -= hit.normal * glm::dot(move, hit.normal);
+    }
+    return pos;
+}
+
 // GLuint flatShader;
 GLuint blinnShader;
 GLuint phongShader;
@@ -156,6 +202,64 @@ glm::vec3 GetCameraWorldPosFromView(const glm::mat4& view)
 
 
 
+// selects every mesh with a triangle inside the screen rectangle (x0, y0)-(x1, y1),
+// or with ALT held the triangles of the picked mesh inside it
+static void MarqueeSelect(GLFWwindow *win, double x0, double y0, double x1, double y1, int mods)
+{
+    int fbW, fbH;
+    glfwGetFramebufferSize(win, &fbW, &fbH);
+
+    // the rectangle in NDC, and a matrix stretching it over the whole clip space
+    float nx0 = 2.0f * (float)std::min(x0, x1) / fbW - 1.0f;
+    float nx1 = 2.0f * (float)std::max(x0, x1) / fbW - 1.0f;
+    float ny0 = 1.0f - 2.0f * (float)std::max(y0, y1) / fbH;
+    float ny1 = 1.0f - 2.0f * (float)std::min(y0, y1) / fbH;
+
+    // a flat or thin drag still selects a strip at least a pixel wide, never a zero extent
+    float minW = 2.0f / std::max(fbW, 1), minH = 2.0f / std::max(fbH, 1);
+    if (nx1 - nx0 < minW)
+    {
+        float cx = (nx0 + nx1) * 0.5f;
+        nx0 = cx - minW * 0.5f;
+        nx1 = cx + minW * 0.5f;
+    }
+    if (ny1 - ny0 < minH)
+    {
+        float cy = (ny0 + ny1) * 0.5f;
+        ny0 = cy - minH * 0.5f;
+        ny1 = cy + minH * 0.5f;
+    }
+    glm::mat4 matPick(1.0f);
+    matPick[0][0] = 2.0f / (nx1 - nx0);
+    matPick[1][1] = 2.0f / (ny1 - ny0);
+    matPick[3][0] = -(nx1 + nx0) / (nx1 - nx0);
+    matPick[3][1] = -(ny1 + ny0) / (ny1 - ny0);
+    Frustum frustum = Frustum::FromMatrix(matPick * matProj * matView);
+
+    if ((mods & GLFW_MOD_ALT) && gPickedIndex >= 0)
+    {
+        gSelectedTris.clear();
+        meshList[gPickedIndex]->pSpatial->ForEachInFrustum(frustum, [](int triIdx) { gSelectedTris.push_back(triIdx); });
+        std::cout << "Selected " << gSelectedTris.size() << " triangles of mesh " << gPickedIndex << std::endl;
+        return;
+    }
+
+    gPickedIndex = -1;
+    for (auto &pMesh : meshList)
+        pMesh->setPicked(false);
+
+    // one walk over the TLAS, the first mesh found is the one SHIFT + arrows move
+    int count = 0;
+    gTlas.ForEachInFrustum(frustum, [&](int id) {
+        meshList[id]->setPicked(true);
+        if (gPickedIndex < 0)
+            gPickedIndex = id;
+        count++;
+        return true;
+    });
+    std::cout << "Marquee selected " << count << " meshes" << std::endl;
+}
+
 void mouse_button_callback(GLFWwindow *win, int button, int action, int mods)
 {
     
@@ -174,10 +278,23 @@ void mouse_button_callback(GLFWwindow *win, int button, int action, int mods)
     }
     
     if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS)
+    {
+        // the pick happens on release, when it is known whether this was a drag
+        glfwGetCursorPos(win, &gDragStartX, &gDragStartY);
+        return;
+    }
+
+    if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_RELEASE)
     {
         double mx, my;
         glfwGetCursorPos(win, &mx, &my);
 
+        if (std::abs(mx - gDragStartX) > 4.0 || std::abs(my - gDragStartY) > 4.0)
+        {
+            MarqueeSelect(win, gDragStartX, gDragStartY, mx, my, mods);
+            return;
+        }
+
         std::cout << "Mouse click at: (" << mx <<", " << my << ")" << std::endl;
 
         /*int w, h;
@@ -204,21 +321,15 @@ void mouse_button_callback(GLFWwindow *win, int button, int action, int mods)
         for (auto &pMesh : meshList)
             pMesh->setPicked(false);
 
-        for (int i = 0; i < (int)meshList.size(); i++)
+        // the TLAS only visits meshes whose bounds the ray enters
+        HitInfo hit;
+        int hitIndex;
+        if (gTlas.Raycast(ray, hit, hitIndex))
         {
-            auto &pMesh = meshList[i];
-            if (!pMesh->pSpatial) continue;
-            HitInfo hit;
-            if (pMesh->pSpatial->Raycast(ray, hit))
-            {
-                if (hit.t < bestT)
-                {
-                    bestT = hit.t;
-                    bestMesh = pMesh;
-                    gPickedIndex = i;
-                    std::cout << "Picked index: " << gPickedIndex << std::endl;
-                }
-            }
+            bestT = hit.t;
+            bestMesh = meshList[hitIndex];
+            gPickedIndex = hitIndex;
+            std::cout << "Picked index: " << gPickedIndex << std::endl;
         }
 
         if (bestMesh)
@@ -393,6 +504,9 @@ int main()
 
     glm::mat4 mat = glm::mat4(1.0f);
 
+    // the spatial structures below are built together once every mesh is loaded
+    Mesh::beginSpatialBatch();
+
     // Teapot
     /*std::shared_ptr<Mesh> teapot = std::make_shared<Mesh>();
     teapot->init("models/teapot.obj", blinnShader);
@@ -400,7 +514,7 @@ int main()
 
     mat = glm::translate(glm::mat4(1.0f), glm::vec3(-2.0f, 1.0f, 0.0f));
     meshMatList.push_back(mat);
-    teapot->initSpatial(true, mat);*/
+    teapot->initSpatial(gSpatialType, mat);*/
     // 4 Mugs
     for (int i = 0; i < 4; i++)
     {
@@ -415,7 +529,7 @@ int main()
         mugMat = glm::scale(mugMat, glm::vec3(10.0f));
         meshMatList.push_back(mugMat);
 
-        mug->initSpatial(true, mugMat);
+        mug->initSpatial(gSpatialType, mugMat, gInstanced);
     }
 
 
@@ -444,7 +558,7 @@ int main()
             wallMat = glm::scale(wallMat, glm::vec3(1.0f, 1.0f, 1.0f));
 
             meshMatList.push_back(wallMat);
-            wallLR->initSpatial(true, wallMat);
+            wallLR->initSpatial(gSpatialType, wallMat, gInstanced);
         }
     }
     // Extra wall in front of the MIDDLE TOP one (above the door)
@@ -461,7 +575,7 @@ int main()
     // extraMat = extraMat * glm::rotate(glm::mat4(1.0f), glm::radians(180.0f), glm::vec3(0,1,0));
 
     meshMatList.push_back(extraMat);
-    wallFrontTopMid->initSpatial(true, extraMat);
+    wallFrontTopMid->initSpatial(gSpatialType, extraMat, gInstanced);
 
     
     // window front walls
@@ -489,7 +603,7 @@ int main()
             windowMat = windowMat * glm::rotate(glm::mat4(1.0f), glm::radians(180.0f), glm::vec3(0.0f, 1.0f, 0.0f));
 
             meshMatList.push_back(windowMat);
-            wallPWindow->initSpatial(true, windowMat);
+            wallPWindow->initSpatial(gSpatialType, windowMat, gInstanced);
         }
     }
     // wall door
@@ -503,7 +617,7 @@ int main()
 	doorMat = doorMat * glm::rotate(glm::mat4(1.0f), glm::radians(180.0f), glm::vec3(0.0f, 1.0f, 0.0f));
     
     meshMatList.push_back(doorMat);
-    wallPDoor->initSpatial(true, doorMat);
+    wallPDoor->initSpatial(gSpatialType, doorMat, gInstanced);
 
 	// Roof pieces
     std::vector<int> roofIndices;
@@ -533,12 +647,15 @@ int main()
             // roofMat = roofMat * glm::rotate(glm::mat4(1.0f), glm::radians(180.0f), glm::vec3(0,1,0));
 
             meshMatList.push_back(roofMat);
-            roof->initSpatial(true, roofMat);
+            roof->initSpatial(gSpatialType, roofMat, gInstanced);
         }
     }
 
 
     // ---------- End Of Medieval House ----------
+
+    Mesh::endSpatialBatch();
+    BuildSceneTlas();
     
     // Background 
     glClearColor(0.12f, 0.05f, 0.18f, 1.0f); // dark purple
@@ -693,8 +810,10 @@ void key_callback(GLFWwindow *window, int key, int scancode, int action, int mod
             {
                 glm::mat4 t = glm::translate(glm::mat4(1.0f), d);
                 meshMatList[gPickedIndex] = t * meshMatList[gPickedIndex];
-                // Rebuild spatial structure so picking/collision stays correct after movement
-                meshList[gPickedIndex]->initSpatial(true, meshMatList[gPickedIndex]);
+                // Move the spatial structure with the mesh (instances only swap their matrix)
+                // and update its TLAS leaf so picking/collision stays correct
+                meshList[gPickedIndex]->pSpatial->SetTransform(meshMatList[gPickedIndex]);
+                gTlas.Update(gPickedIndex);
                 return;
             }
         }
@@ -761,38 +880,11 @@ void key_callback(GLFWwindow *window, int key, int scancode, int action, int mod
             if (key == GLFW_KEY_D) move += right * transStep;
             if (key == GLFW_KEY_A) move -= right * transStep;
 
-            // Propose a new target position
-            glm::vec3 proposedTarget = gCamTarget + move;
-
-            // Build the *proposed* camera position from that target
-            glm::vec3 proposedCamPos;
-            glm::mat4 proposedView;
-            BuildOrbitCamera(proposedTarget, gCamDistance, gCamYaw, gCamPitch, proposedCamPos, proposedView);
-
-            // Collision test uses the proposed camera position
-            AABB mybox{ proposedCamPos - glm::vec3(0.2f), proposedCamPos + glm::vec3(0.2f) };
-
-            bool bCollide = false;
-            for (const std::shared_ptr<Mesh>& pMesh : meshList)
-            {
-                if (!pMesh || !pMesh->pSpatial) continue;
-
-                std::vector<int> out;
-                pMesh->pSpatial->QueryAABB(mybox, out);
-                if (!out.empty())
-                {
-                    bCollide = true;
-                    break;
-                }
-            }
-
-            // Only commit move if no collision
-            if (!bCollide)
-            {
-                gCamTarget = proposedTarget;
-                
-                UpdateOrbitCamera();
-            }
+            // Sweep the camera along the move, it slides along walls instead of
+            // stopping or tunnelling through them; the target follows the camera
+            glm::vec3 camPos = SlideSphere(viewPos, move, 0.2f);
+            gCamTarget += camPos - viewPos;
+            UpdateOrbitCamera();
 
             return; 
         }
@@ -837,21 +929,8 @@ void key_callback(GLFWwindow *window, int key, int scancode, int action, int mod
         // check collision detection
         AABB mybox{ nextViewPos - glm::vec3(0.2f), nextViewPos + glm::vec3(0.2f) };
 
-        bool bCollide = false;
-
-        for (const std::shared_ptr<Mesh>& pMesh : meshList)
-        {
-            if (!pMesh || !pMesh->pSpatial) continue;
-
-            std::vector<int> out;
-            pMesh->pSpatial->QueryAABB(mybox, out);
-
-            if (!out.empty())
-            {
-                bCollide = true;
-                break; // stop as soon as we hit something
-            }
-        }
+        // only triangles really touching the box count, stops at the first one
+        bool bCollide = gTlas.Overlaps(mybox);
 
         if (!bCollide) {
             matView = nextMatView;